@@ -0,0 +1,144 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * autoexp.c - auto exposure controller
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Sensor is linear: level of any percentile is L = bias + k*exptime, so after
+ * bias subtraction the exposition needed to put controlled percentile to
+ * target level is exptime*(target - bias)/(L - bias). Bias is estimated by
+ * two last frames with different expositions (or by low percentile until
+ * there's no such pair). Correction is damped (in log scale) & rate-limited;
+ * too many saturated pixels cut exposition at once.
+ */
+
+#include "autoexp.h"
+#include "usefull_macros.h"
+
+#include <math.h>
+
+static struct{
+    double target;  // target level (part of full range)
+    double pct;     // controlled percentile
+    double gain;    // damping
+    double maxstep; // rate limit
+    double satmax;  // saturation guard
+} par = {AE_TARGET, AE_PERCENTILE, AE_GAIN, AE_MAXSTEP, AE_SATMAX};
+
+// last measurement
+static struct{
+    double exptime;     // exposition time
+    double level;       // level of controlled percentile
+    int binning;        // image binning (level depends on it)
+    int valid;          // ==1 if there's measurement
+} last = {0};
+static double bias = -1.; // bias level estimate (<0 - unknown)
+
+/**
+ * Set controller parameters (values <= 0 leave unchanged)
+ * @return 0 if all OK
+ */
+int autoexp_setup(double target, double pct, double gain, double maxstep, double satmax){
+    #define CHK(val, min, max, name) do{if(val > 0.){if(val < min || val > max){ \
+        WARNX(_("%s should be in range %g..%g"), name, min, max); return 1;}}}while(0)
+    CHK(target, 0.01, 0.95, "ae-target");
+    CHK(pct, 0.01, 0.9999, "ae-pct");
+    CHK(gain, 0.05, 1., "ae-gain");
+    CHK(maxstep, 1.1, 1000., "ae-maxstep");
+    CHK(satmax, 1e-6, 0.5, "ae-satmax");
+    #undef CHK
+    if(target > 0.) par.target = target;
+    if(pct > 0.) par.pct = pct;
+    if(gain > 0.) par.gain = gain;
+    if(maxstep > 0.) par.maxstep = maxstep;
+    if(satmax > 0.) par.satmax = satmax;
+    return 0;
+}
+
+// level of percentile `p` by histogram `h` of `N` pixels
+static double percentile(const uint32_t *h, size_t N, double p){
+    size_t need = (size_t)(p * N), acc = 0;
+    for(int i = 0; i < 65536; ++i){
+        acc += h[i];
+        if(acc > need) return (double)i;
+    }
+    return 65535.;
+}
+
+/**
+ * Calculate exposition for next image by `img`
+ * @param maxexp - maximal exposition time
+ * @return exposition time
+ */
+double autoexp_next(imstorage *img, double maxexp){
+    static uint32_t hist[65536];
+    double t = img->exptime;
+    if(!img->imdata || img->imtype == IMTYPE_DARK || t <= 0.) return t;
+    // full 16-bit histogram of good rows
+    memset(hist, 0, sizeof(hist));
+    size_t N = 0, W = img->W;
+    for(size_t y = 0; y < img->H; ++y){
+        if(img->rowmask && !img->rowmask[y]) continue;
+        const uint16_t *row = img->imdata + y*W;
+        for(size_t x = 0; x < W; ++x) ++hist[row[x]];
+        N += W;
+    }
+    if(!N) return t;
+    size_t nsat = 0;
+    for(int i = AE_SATLEVEL; i < 65536; ++i) nsat += hist[i];
+    double low = percentile(hist, N, 0.001), L = percentile(hist, N, par.pct);
+    double E, sat = (double)nsat / N;
+    if(sat > par.satmax){ // saturation guard
+        E = t / AE_SATDIV;
+        DBG("saturated: %g", sat);
+        last.valid = 0; // level is wrong
+    }else{
+        // refine bias by two last frames
+        if(last.valid && last.binning == img->binning && last.level < AE_SATLEVEL
+           && fabs(log(t / last.exptime)) > log(AE_FITRATIO)){
+            double k = (L - last.level) / (t - last.exptime);
+            if(k > 0.){
+                double b = L - k * t;
+                if(b < 0.) b = 0.;
+                else if(b > low) b = low;
+                bias = b;
+                DBG("k=%g, bias=%g", k, bias);
+            }
+        }
+        if(bias < 0. || bias > low) bias = low;
+        last.exptime = t;
+        last.level = L;
+        last.binning = img->binning;
+        last.valid = 1;
+        double S = L - bias, St = par.target * 65535. - bias;
+        if(S < 1.) S = 1.;
+        if(St < 1.) St = 1.;
+        double lr = log(St / S);
+        if(fabs(lr) < log(1. + AE_DEADBAND)) lr = 0.;
+        lr *= par.gain;
+        double lmax = log(par.maxstep);
+        if(lr > lmax) lr = lmax;
+        else if(lr < -lmax) lr = -lmax;
+        E = t * exp(lr);
+    }
+    if(E < AE_MINEXP) E = AE_MINEXP;
+    else if(E > maxexp) E = maxexp;
+    printf("%g%% level: %.0f, bias: %.0f, saturated: %.2f%%\n", par.pct*100., L, bias, sat*100.);
+    return E;
+}
@@ -0,0 +1,52 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * autoexp.h - auto exposure controller
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __AUTOEXP_H__
+#define __AUTOEXP_H__
+
+#include "imfunctions.h"
+
+// default parameters
+// level of controlled percentile (part of full range)
+#define AE_TARGET       (0.5)
+// controlled percentile
+#define AE_PERCENTILE   (0.95)
+// part of exposition correction (in log scale) applied by one step
+#define AE_GAIN         (0.8)
+// maximal change of exposition by one step (times)
+#define AE_MAXSTEP      (8.)
+// maximal part of saturated pixels
+#define AE_SATMAX       (0.002)
+// pixels above this level are saturated
+#define AE_SATLEVEL     (65000)
+// exposition divider when there's too many saturated pixels
+#define AE_SATDIV       (4.)
+// don't change exposition if correction is less than this
+#define AE_DEADBAND     (0.05)
+// minimal exposition ratio of two frames to estimate bias by them
+#define AE_FITRATIO     (1.2)
+// minimal exposition time
+#define AE_MINEXP       (5e-5)
+
+int autoexp_setup(double target, double pct, double gain, double maxstep, double satmax);
+double autoexp_next(imstorage *img, double maxexp);
+
+#endif // __AUTOEXP_H__
@@ -0,0 +1,179 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * bench.c - capture throughput benchmark
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#if !defined DAEMON && !defined CLIENT
+
+/*
+ * Benchmark runs full capture cycle (start_exposition -> wait4image ->
+ * get_image -> store_image) for all given speeds and binnings 0, 1, 2 and
+ * subframe. Results are written as JSON lines (one line per configuration).
+ * Run it against emulator: `make bench`
+ */
+
+#include "bench.h"
+#include "chksum.h"
+#include "imfunctions.h"
+#include "term.h"
+#include "usefull_macros.h"
+
+static FILE *out = NULL;
+
+static int dblcmp(const void *a, const void *b){
+    double d1 = *(const double*)a, d2 = *(const double*)b;
+    if(d1 < d2) return -1;
+    if(d1 > d2) return 1;
+    return 0;
+}
+
+// percentile `p` (0..1) of sorted array
+static double percentile(const double *arr, size_t n, double p){
+    if(!n) return 0.;
+    size_t idx = (size_t)(p * (n - 1) + 0.5);
+    return arr[idx];
+}
+
+// throughput of block checksum kernels
+static void bench_chksum(){
+    #define CSBUFSZ (8192)
+    #define CSNITER (20000)
+    static uint8_t buf[CSBUFSZ + 8];
+    for(size_t i = 0; i < sizeof(buf); ++i) buf[i] = (uint8_t)(i * 7 + (i >> 5));
+    struct{
+        const char *name;
+        uint8_t (*fn)(const uint8_t*, size_t);
+    } kernels[] = {{"scalar", xor_scalar}, {"words", xor_words}, {xor_kernel_name(), xor_chksum}};
+    uint8_t ref = xor_scalar(buf + 1, CSBUFSZ);
+    for(size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); ++k){
+        volatile uint8_t cs = 0;
+        double t0 = mtime();
+        for(int i = 0; i < CSNITER; ++i) cs ^= kernels[k].fn(buf + (i & 7), CSBUFSZ);
+        double t = mtime() - t0;
+        fprintf(out, "{\"test\":\"chksum\",\"kernel\":\"%s\",\"valid\":%d,\"MBps\":%.1f}\n",
+                kernels[k].name, kernels[k].fn(buf + 1, CSBUFSZ) == ref,
+                (double)CSBUFSZ * CSNITER / t / 1e6);
+    }
+    #undef CSBUFSZ
+    #undef CSNITER
+}
+
+// benchmark for one speed & binning
+static void bench_conf(imstorage *img, char *imtype, int speed, int binning, int nframes){
+    size_t nlat = 0, maxlat = 0, resends = 0, bytes = 0, lost = 0;
+    double *lat = NULL, xfertime = 0., frametime = 0.;
+    int good = 0, errors = 0;
+    const char *bname = (binning == 0xff) ? "subframe" : (binning == 2) ? "binned" : (binning == 1) ? "cropped" : "full";
+    for(int i = 0; i < nframes; ++i){
+        double t0 = mtime();
+        img->binning = binning;
+        if(start_exposition(img, imtype) || wait4image()){
+            ++errors;
+            continue;
+        }
+        FREE(img->imdata);
+        if(!(img->imdata = get_image(img))){
+            ++errors;
+            continue;
+        }
+        const xfer_stat *x = get_xfer_stat();
+        if(nlat + x->blocks > maxlat){
+            maxlat = nlat + x->blocks;
+            lat = realloc(lat, maxlat * sizeof(double));
+            if(!lat) ERR("realloc()");
+        }
+        memcpy(lat + nlat, x->blktime, x->blocks * sizeof(double));
+        nlat += x->blocks;
+        resends += x->resends;
+        lost += x->lost;
+        bytes += x->bytes;
+        xfertime += x->time;
+        if(store_image(img)) ++errors;
+        frametime += mtime() - t0;
+        ++good;
+    }
+    qsort(lat, nlat, sizeof(double), dblcmp);
+    double ft = good ? frametime / good : 0.;
+    fprintf(out, "{\"test\":\"capture\",\"speed\":%d,\"binning\":\"%s\",\"exptime\":%g,"
+            "\"frames\":%d,\"errors\":%d,\"frame_time\":%.3f,\"frames_per_min\":%.2f,"
+            "\"bytes_per_s\":%.0f,\"blocks\":%zd,\"resends\":%zd,\"lost\":%zd,"
+            "\"blk_p50_ms\":%.2f,\"blk_p90_ms\":%.2f,\"blk_p99_ms\":%.2f,\"blk_max_ms\":%.2f}\n",
+            speed, bname, img->exptime, good, errors, ft, ft > 0. ? 60. / ft : 0.,
+            xfertime > 0. ? bytes / xfertime : 0., nlat, resends, lost,
+            1e3 * percentile(lat, nlat, 0.5), 1e3 * percentile(lat, nlat, 0.9),
+            1e3 * percentile(lat, nlat, 0.99), nlat ? 1e3 * lat[nlat - 1] : 0.);
+    fflush(out);
+    FREE(lat);
+}
+
+/**
+ * Run benchmark
+ * @return 0 if all OK
+ */
+int run_bench(glob_pars *G){
+    if(G->benchout){
+        if(!(out = fopen(G->benchout, "a"))){
+            WARN(_("Can't open %s"), G->benchout);
+            return 1;
+        }
+    }else out = stdout;
+    bench_chksum();
+    imstorage *img = MALLOC(imstorage, 1);
+    img->imname = strdup(G->outpfname);
+    img->exptime = G->exptime;
+    if(!chk_storeimg(img, "rewrite", G->imformat ? G->imformat : "r")) return 1;
+    if(!(img->subframe = define_subframe(G->subframe ? G->subframe : "1,1,127"))) return 2;
+    // list of speeds
+    int nspd;
+    const int *allspd = get_speeds(&nspd);
+    int *spds = MALLOC(int, nspd), N = 0;
+    if(G->benchspd){
+        char *p = G->benchspd, *e;
+        while(*p && N < nspd){
+            long s = strtol(p, &e, 10);
+            if(e == p) break;
+            spds[N++] = (int) s;
+            p = (*e == ',') ? e + 1 : e;
+        }
+    }else{
+        memcpy(spds, allspd, nspd * sizeof(int));
+        N = nspd;
+    }
+    const int binnings[] = {0, 1, 2, 0xff};
+    for(int s = 0; s < N; ++s){
+        if(term_setspeed(spds[s])){
+            fprintf(out, "{\"test\":\"capture\",\"speed\":%d,\"error\":\"can't set speed\"}\n", spds[s]);
+            continue;
+        }
+        for(size_t b = 0; b < sizeof(binnings)/sizeof(binnings[0]); ++b){
+            if(binnings[b] == 0 && G->imtype && (*G->imtype == 'a' || *G->imtype == 'A'))
+                continue; // autodark don't support full frame
+            bench_conf(img, G->imtype, spds[s], binnings[b], G->bench);
+        }
+    }
+    FREE(spds);
+    FREE(img->imdata);
+    FREE(img->rowmask);
+    FREE(img->subframe);
+    FREE(img->imname);
+    FREE(img);
+    if(out != stdout) fclose(out);
+    return 0;
+}
+
+#endif // !DAEMON && !CLIENT
@@ -0,0 +1,142 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * chksum.c - XOR checksum of image data blocks
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include "chksum.h"
+#include "usefull_macros.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+
+/*
+ * Checksum of image block is XOR of all its bytes. XOR is associative, so
+ * checksum of whole block is XOR of checksums of its parts: data could be
+ * processed by portions as they come and by words of any width.
+ */
+
+/**
+ * Reference (bytewise) checksum
+ */
+uint8_t xor_scalar(const uint8_t *data, size_t len){
+    uint8_t cs = 0;
+    while(len--) cs ^= *data++;
+    return cs;
+}
+
+// fold 64-bit word into one byte
+static inline uint8_t fold64(uint64_t w){
+    w ^= w >> 32;
+    w ^= w >> 16;
+    w ^= w >> 8;
+    return (uint8_t)w;
+}
+
+/**
+ * Checksum by 64-bit words
+ */
+uint8_t xor_words(const uint8_t *data, size_t len){
+    uint8_t cs = 0;
+    while(len && ((uintptr_t)data & 7)){ // unaligned head
+        cs ^= *data++; --len;
+    }
+    const uint64_t *w = (const uint64_t*)data;
+    uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+    for(; len >= 32; len -= 32, w += 4){
+        a0 ^= w[0]; a1 ^= w[1]; a2 ^= w[2]; a3 ^= w[3];
+    }
+    for(; len >= 8; len -= 8) a0 ^= *w++;
+    cs ^= fold64(a0 ^ a1 ^ a2 ^ a3);
+    data = (const uint8_t*)w;
+    while(len--) cs ^= *data++;
+    return cs;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/**
+ * Checksum by 256-bit words
+ */
+__attribute__((target("avx2")))
+static uint8_t xor_avx2(const uint8_t *data, size_t len){
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+    for(; len >= 64; len -= 64, data += 64){
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i*)data));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i*)(data + 32)));
+    }
+    a0 = _mm256_xor_si256(a0, a1);
+    uint64_t w = (uint64_t)_mm256_extract_epi64(a0, 0) ^ (uint64_t)_mm256_extract_epi64(a0, 1) ^
+                 (uint64_t)_mm256_extract_epi64(a0, 2) ^ (uint64_t)_mm256_extract_epi64(a0, 3);
+    return fold64(w) ^ xor_words(data, len);
+}
+#endif
+
+static uint8_t (*kernel)(const uint8_t*, size_t) = NULL;
+static const char *kname = NULL;
+
+/**
+ * Check kernel `k` against reference on different lengths & alignments
+ * @return 0 if all OK
+ */
+static int selftest(uint8_t (*k)(const uint8_t*, size_t)){
+    uint8_t buf[300];
+    uint32_t x = 0x12345678;
+    for(size_t i = 0; i < sizeof(buf); ++i){
+        x = x * 1103515245 + 12345;
+        buf[i] = x >> 16;
+    }
+    for(size_t off = 0; off < 9; ++off)
+        for(size_t l = 0; l + off <= sizeof(buf); l += 7)
+            if(k(buf + off, l) != xor_scalar(buf + off, l)) return 1;
+    return 0;
+}
+
+// choose the fastest kernel supported by CPU which passes self-test
+static void choose_kernel(){
+#ifdef HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && !selftest(xor_avx2)){
+        kernel = xor_avx2; kname = "avx2";
+        return;
+    }
+#endif
+    if(!selftest(xor_words)){
+        kernel = xor_words; kname = "words";
+        return;
+    }
+    WARNX("XOR checksum self-test failed, use bytewise calculation");
+    kernel = xor_scalar; kname = "scalar";
+}
+
+/**
+ * Calculate XOR checksum by the best kernel for current CPU
+ */
+uint8_t xor_chksum(const uint8_t *data, size_t len){
+    if(!kernel) choose_kernel();
+    return kernel(data, len);
+}
+
+/**
+ * @return name of kernel used by xor_chksum()
+ */
+const char *xor_kernel_name(){
+    if(!kernel) choose_kernel();
+    return kname;
+}
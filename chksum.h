@@ -0,0 +1,33 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * chksum.h - XOR checksum of image data blocks
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __CHKSUM_H__
+#define __CHKSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint8_t xor_scalar(const uint8_t *data, size_t len);
+uint8_t xor_words(const uint8_t *data, size_t len);
+uint8_t xor_chksum(const uint8_t *data, size_t len);
+const char *xor_kernel_name();
+
+#endif // __CHKSUM_H__
@@ -24,6 +24,8 @@
 #include <strings.h>
 #include <math.h>
 #include "cmdlnopts.h"
+#include "ephem.h"
+#include "socket.h"
 #include "usefull_macros.h"
 
 /*
@@ -46,6 +48,17 @@ glob_pars const Gdefault = {
     .shutter_cmd = NULL,
     .subframe = NULL,
     .speed = 0,
+#ifdef DAEMON
+    .autospeed = 1,
+#else
+    .autospeed = 0,
+#endif
+    .partial = 0,
+    .ae_target = -1.,
+    .ae_pct = -1.,
+    .ae_gain = -1.,
+    .ae_maxstep = -1.,
+    .ae_satmax = -1.,
     .exptime = 1e-4,
     .binning = 0,
     .takeimg = 0,
@@ -54,13 +67,28 @@ glob_pars const Gdefault = {
     .imstoretype = NULL,
     .outpfname = "output.fits",
     .hostname = NULL,
+    .product = NULL,
+    .frame = -1,
+    .since = -1,
+    .compress = 0,
+    .delta = 0,
+    .ring = RING_LEN,
+    .keyframes = KEYFRAMES,
     .port = "4444",
     .once = 0,
     .timestamp = 0,
     .dark_interval = 1800.,
+    .dark_stack = 0,
+    .dark_combine = NULL,
+    .hotpix = NULL,
     .min_dark_exp = 30.,
     .max_exptime = -1.,
-    .htrperiod = 0
+    .latitude = EPHEM_NOCOORD,
+    .longitude = EPHEM_NOCOORD,
+    .htrperiod = 0,
+    .bench = 0,
+    .benchspd = NULL,
+    .benchout = NULL
 };
 
 /*
@@ -75,6 +103,9 @@ myoption cmdlnopts[] = {
     {"imtype",  NEED_ARG,   NULL,   'T',    arg_string, APTR(&G.imtype),    _("image type: light (l, L), autodark (a, A), dark (d, D); default: light")},
     {"terminal",NO_ARGS,    NULL,   't',    arg_int,    APTR(&G.terminal),  _("run as terminal")},
     {"start-exp",NO_ARGS,   NULL,   'X',    arg_int,    APTR(&G.takeimg),   _("start exposition")},
+    {"bench",   NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.bench),     _("run capture benchmark taking N frames for each speed and binning")},
+    {"bench-spd",NEED_ARG,  NULL,   0,      arg_string, APTR(&G.benchspd),  _("comma-separated list of speeds for benchmark (default: all)")},
+    {"bench-out",NEED_ARG,  NULL,   0,      arg_string, APTR(&G.benchout),  _("file to append benchmark results (default: stdout)")},
 #endif
 // not daemon options
 #ifndef DAEMON
@@ -82,6 +113,12 @@ myoption cmdlnopts[] = {
     {"output",  NEED_ARG,   NULL,   'o',    arg_string, APTR(&G.outpfname), _("output file name (default: output.fits)")},
     {"imformat",NEED_ARG,   NULL,   'f',    arg_string, APTR(&G.imformat),  _("image format: FITS (f), TIFF (t), raw dump with histogram storage (r,d), may be OR'ed; default: FITS or based on output image name")},
 #endif
+// options of images calibration (daemon calibrates its products)
+#if !defined DAEMON || defined PRODUCTS
+    {"dark-stack",NEED_ARG, NULL,   0,      arg_int,    APTR(&G.dark_stack),_("amount of last darks of each exposition to build master dark (default: 8)")},
+    {"dark-combine",NEED_ARG,NULL,  0,      arg_string, APTR(&G.dark_combine),_("master dark combining method: 'median' or 'sigma' (sigma-clipped mean, default)")},
+    {"hotpix",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.hotpix),    _("file to load hot pixels maps from & save them to after each dark")},
+#endif
 // not client options
 #ifndef CLIENT
     {"exptime-max",NEED_ARG,NULL,   0,      arg_double, APTR(&G.max_exptime),_("maximal exposition time (seconds)")},
@@ -92,8 +129,19 @@ myoption cmdlnopts[] = {
     {"spd-list",NO_ARGS,    NULL,   'l',    arg_int,    APTR(&G.splist),    _("list speeds available")},
     {"baudrate",NEED_ARG,   NULL,   'b',    arg_int,    APTR(&G.speed),     _("connect at given baudrate without autocheck")},
     {"spd-set", NEED_ARG,   NULL,   's',    arg_int,    APTR(&G.newspeed),  _("set terminal speed")},
+#ifdef DAEMON
+    {"spd-noauto",NO_ARGS,  APTR(&G.autospeed),0,   arg_none,   NULL,       _("don't change speed by link quality")},
+#else
+    {"spd-auto",NO_ARGS,    APTR(&G.autospeed),1,   arg_none,   NULL,       _("go to the highest speed with good link quality")},
+#endif
     {"shutter", NEED_ARG,   NULL,   0,      arg_string, APTR(&G.shutter_cmd),_("shutter command: 'o' for open, 'c' for close, 'k' for de-energize")},
     {"subframe",NEED_ARG,   NULL,   0,      arg_string, APTR(&G.subframe),  _("select subframe: x,y,size")},
+    {"ae-target",NEED_ARG,  NULL,   0,      arg_double, APTR(&G.ae_target), _("auto exposure: level of controlled percentile, part of full range (default: 0.5)")},
+    {"ae-pct",  NEED_ARG,   NULL,   0,      arg_double, APTR(&G.ae_pct),    _("auto exposure: controlled percentile (default: 0.95)")},
+    {"ae-gain", NEED_ARG,   NULL,   0,      arg_double, APTR(&G.ae_gain),   _("auto exposure: part of correction applied by one step, 0.05..1 (default: 0.8)")},
+    {"ae-maxstep",NEED_ARG, NULL,   0,      arg_double, APTR(&G.ae_maxstep),_("auto exposure: maximal change of exposition time by one step, times (default: 8)")},
+    {"ae-satmax",NEED_ARG,  NULL,   0,      arg_double, APTR(&G.ae_satmax), _("auto exposure: maximal part of saturated pixels (default: 0.002)")},
+    {"partial", NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.partial),   _("keep images with lost blocks (filled by zeros, their rows marked as bad)")},
     {"exptime", NEED_ARG,   NULL,   'x',    arg_double, APTR(&G.exptime),   _("exposition time in seconds (default: 1s)")},
     {"binning", NEED_ARG,   NULL,   'B',    arg_int,    APTR(&G.binning),   _("binning (default 0: full size)")},
 #endif
@@ -101,6 +149,11 @@ myoption cmdlnopts[] = {
 #if defined DAEMON || defined CLIENT
 #ifndef DAEMON
     {"hostname",NEED_ARG,   NULL,   'H',    arg_string, APTR(&G.hostname),  _("hostname to connect (default: localhost)")},
+    {"product", NEED_ARG,   NULL,   0,      arg_string, APTR(&G.product),   _("get image encoded by daemon: 'fits', 'tiff' or 'jpeg' (daemon should be built with DAEMONIMG=1)")},
+    {"frame",   NEED_ARG,   NULL,   0,      arg_longlong,APTR(&G.frame),    _("get only image with given number (if it's still kept by daemon) and exit")},
+    {"since",   NEED_ARG,   NULL,   0,      arg_longlong,APTR(&G.since),    _("get all images after given number (kept by daemon) and then new ones")},
+    {"compress",NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.compress),  _("get images compressed (lossless) by daemon")},
+    {"delta",   NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.delta),     _("get images compressed (lossless) by previous ones (stream of images)")},
     {"once",    NO_ARGS,    NULL,   '1',    arg_int,    APTR(&G.once),      _("run client just once")},
     {"timestamp",NO_ARGS,   NULL,   't',    arg_int,    APTR(&G.timestamp), _("add timestamp to filename")},
 #endif
@@ -108,8 +161,12 @@ myoption cmdlnopts[] = {
 #endif
 // only daemon options
 #ifdef DAEMON
-    {"dark-interval",NEED_ARG,NULL, 'D',    arg_double, APTR(&G.dark_interval),_("time interval (in seconds) between dark images taken (default: 1800)")},
+    {"dark-interval",NEED_ARG,NULL, 'D',    arg_double, APTR(&G.dark_interval),_("maximal age (in seconds) of dark for each exposition bucket (default: 1800)")},
     {"min-dark-exp",NEED_ARG,NULL,  'E',    arg_double, APTR(&G.min_dark_exp),_("minimal exposition (in seconds) at which darks would be taken (default: 30)")},
+    {"lat",     NEED_ARG,   NULL,   0,      arg_double, APTR(&G.latitude),  _("site latitude (degrees, north is positive) to predict exposition by Sun & Moon altitude")},
+    {"long",    NEED_ARG,   NULL,   0,      arg_double, APTR(&G.longitude), _("site longitude (degrees, east is positive)")},
+    {"ring",    NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.ring),      _("amount of last images kept in memory for clients (1..64, default: 8)")},
+    {"keyframes",NEED_ARG,  NULL,   0,      arg_int,    APTR(&G.keyframes), _("send each N'th image of delta compressed stream as is (default: 16)")},
 #endif
    end_option
 };
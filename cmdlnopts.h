@@ -39,6 +39,13 @@ typedef struct{
     int timestamp;          // add timestamp
     int newspeed;           // change speed
     int speed;              // connect @ this speed
+    int autospeed;          // climb to the best speed by link quality
+    int partial;            // keep images with lost blocks
+    double ae_target;       // auto exposure: target level of controlled percentile (part of full range)
+    double ae_pct;          // auto exposure: controlled percentile
+    double ae_gain;         // auto exposure: damping (part of correction applied by one step)
+    double ae_maxstep;      // auto exposure: maximal change of exposition by one step
+    double ae_satmax;       // auto exposure: maximal part of saturated pixels
     char *shutter_cmd;      // shutter command: 'o' for open, 'c' for close, 'k' for de-energize
     char *subframe;         // select subframe (x,y,size)
     double exptime;         // exsposition time (1s by default)
@@ -49,11 +56,26 @@ typedef struct{
     char *outpfname;        // output filename for image storing
     char *imformat;         // output file format
     char *hostname;         // hostname to connect
+    char *product;          // encoded image to get from daemon
+    long long frame;        // number of image to get from daemon's ring
+    long long since;        // get all images after this number from daemon's ring
+    int compress;           // get compressed images from daemon
+    int delta;              // get images compressed by previous ones
+    int ring;               // amount of last images kept by daemon
+    int keyframes;          // period of key images for delta compression
     char *port;             // port to connect
-    double dark_interval;   // time interval (in seconds) between dark images taken
+    double dark_interval;   // maximal age (in seconds) of dark for each exposition bucket
+    int dark_stack;         // amount of darks to build master dark
+    char *dark_combine;     // master dark combining method: "median" or "sigma"
+    char *hotpix;           // file with hot pixels maps
     double min_dark_exp;    // minimal exposition (in seconds) @ which darks would be taken
     double max_exptime;     // maximal exposition time
+    double latitude;        // site latitude (degrees, north is positive)
+    double longitude;       // site longitude (degrees, east is positive)
     int htrperiod;          // new value for heater ON time (0..3599 seconds)
+    int bench;              // run benchmark with given amount of frames per configuration
+    char *benchspd;         // comma-separated list of speeds for benchmark
+    char *benchout;         // benchmark output file (JSON lines)
     char** rest_pars;       // the rest parameters: array of char*
 } glob_pars;
 
@@ -0,0 +1,357 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * darklib.c - library of dark frames
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Darks are stored by image geometry (binning & size) and exposition bucket:
+ * bucket N holds expositions from 2^(N-1/2) to 2^(N+1/2) seconds. Dark
+ * current is linear by time, so dark of other exposition is scaled:
+ * D' = bias + (D - bias) * t_image / t_dark. Daemon keeps only times of darks
+ * to know when bucket becomes stale, clients keep data to subtract.
+ * Clients keep last `nstack` darks of each bucket and subtract master dark:
+ * their median or sigma-clipped mean (less noisy than single dark). Master is
+ * built by tiles of DARKLIB_TILE pixels shared between threads.
+ */
+
+#include "darklib.h"
+#include "events.h"
+#include "hotpix.h"
+#include "usefull_macros.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <strings.h> // strncasecmp
+#include <unistd.h>  // sysconf
+
+// single dark of stack
+typedef struct{
+    uint16_t *data;
+    double exptime;
+    double time;
+    double bias;
+} darkraw;
+
+typedef struct{
+    int binning;
+    size_t W, H;
+    int bucket;         // exposition bucket
+    double exptime;     // exposition time
+    double time;        // UNIX time of exposition start
+    double bias;        // bias level estimate
+    uint16_t *data;     // master dark or NULL
+    darkraw raw[DARKLIB_NSTACK_MAX]; // last darks (from oldest to newest)
+    int nraw;
+} darkframe;
+
+static darkframe lib[DARKLIB_MAX];
+static int nlib = 0;
+static double maxage = DARKLIB_MAXAGE;
+static int nstack = DARKLIB_NSTACK;
+static dark_combine combine = DARK_SIGCLIP;
+static pthread_mutex_t libmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Set maximal age of darks (seconds)
+ */
+void darklib_setup(double age){
+    if(age > 0.) maxage = age;
+}
+
+/**
+ * Set master dark parameters
+ * @param n      - amount of darks in stack (<=0 - leave unchanged)
+ * @param method - "median" or "sigma" (NULL - leave unchanged)
+ * @return 0 if all OK
+ */
+int darklib_stacking(int n, const char *method){
+    if(n > DARKLIB_NSTACK_MAX){
+        WARNX(_("Dark stack should be not more than %d"), DARKLIB_NSTACK_MAX);
+        return 1;
+    }
+    if(n > 0) nstack = n;
+    if(method){
+        int L = strlen(method);
+        if(L && 0 == strncasecmp(method, "median", L)) combine = DARK_MEDIAN;
+        else if(L && 0 == strncasecmp(method, "sigma", L)) combine = DARK_SIGCLIP;
+        else{
+            WARNX(_("Wrong dark combine method: %s, should be \"median\" or \"sigma\""), method);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// free all data of bucket
+static void freebucket(darkframe *d){
+    FREE(d->data);
+    for(int i = 0; i < d->nraw; ++i) FREE(d->raw[i].data);
+    d->nraw = 0;
+}
+
+// bucket number for exposition time `t`
+static int bucket(double t){
+    return (int)floor(log2(t) + 0.5);
+}
+
+// the same geometry of image & dark?
+static int samegeom(const darkframe *d, const imstorage *img){
+    return (d->binning == img->binning && d->W == img->W && d->H == img->H);
+}
+
+// remove darks older than maxage (call with locked mutex)
+static void expire(){
+    double now = dtime();
+    for(int i = 0; i < nlib;){
+        if(now - lib[i].time > maxage){
+            DBG("Dark for %gs too old", lib[i].exptime);
+            freebucket(&lib[i]);
+            lib[i] = lib[--nlib];
+            memset(&lib[nlib], 0, sizeof(darkframe));
+        }else ++i;
+    }
+}
+
+/**
+ * Check if library need dark for image like `img`
+ * @return 1 if there's no fresh dark in bucket of `img` exposition
+ */
+int darklib_stale(imstorage *img){
+    int b = bucket(img->exptime), ret = 1;
+    pthread_mutex_lock(&libmutex);
+    expire();
+    for(int i = 0; i < nlib; ++i){
+        if(lib[i].bucket == b && samegeom(&lib[i], img)){
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&libmutex);
+    return ret;
+}
+
+// level of 0.1% pixels (bias estimate)
+static double darkbias(const uint16_t *data, size_t S){
+    size_t *hist = MALLOC(size_t, 65536), need = S / 1000, acc = 0;
+    for(size_t i = 0; i < S; ++i) ++hist[data[i]];
+    int l = 0;
+    for(; l < 65535; ++l){
+        acc += hist[l];
+        if(acc > need) break;
+    }
+    FREE(hist);
+    return (double)l;
+}
+
+// master dark building job
+typedef struct{
+    darkframe *d;
+    size_t S;           // amount of pixels
+    size_t next;        // next tile to process
+    double k[DARKLIB_NSTACK_MAX]; // exposition scaling of raw darks
+} combjob;
+
+// insertion sort of small array
+static void sortv(double *v, int n){
+    for(int i = 1; i < n; ++i){
+        double x = v[i];
+        int j = i - 1;
+        for(; j >= 0 && v[j] > x; --j) v[j+1] = v[j];
+        v[j+1] = x;
+    }
+}
+
+// combine `n` values of one pixel
+static double combinev(double *v, int n){
+    if(n < 3){
+        double s = 0.;
+        for(int i = 0; i < n; ++i) s += v[i];
+        return s / n;
+    }
+    sortv(v, n);
+    double med = (n & 1) ? v[n/2] : (v[n/2-1] + v[n/2]) / 2.;
+    if(combine == DARK_MEDIAN) return med;
+    // robust sigma by median of absolute deviations (outliers don't spread it),
+    // not less than quantization step
+    double d[DARKLIB_NSTACK_MAX];
+    for(int i = 0; i < n; ++i) d[i] = fabs(v[i] - med);
+    sortv(d, n);
+    double sd = 1.4826 * ((n & 1) ? d[n/2] : (d[n/2-1] + d[n/2]) / 2.);
+    if(sd < 1.) sd = 1.;
+    sd *= DARKLIB_KAPPA;
+    double s = 0.;
+    int N = 0;
+    for(int i = 0; i < n; ++i){
+        if(fabs(v[i] - med) > sd) continue;
+        s += v[i];
+        ++N;
+    }
+    return N ? s / N : med;
+}
+
+static void *comb_thread(void *arg){
+    combjob *j = (combjob*) arg;
+    darkframe *d = j->d;
+    int n = d->nraw;
+    double v[DARKLIB_NSTACK_MAX];
+    while(1){
+        size_t start = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED) * DARKLIB_TILE;
+        if(start >= j->S) break;
+        size_t end = start + DARKLIB_TILE;
+        if(end > j->S) end = j->S;
+        for(size_t p = start; p < end; ++p){
+            for(int i = 0; i < n; ++i){
+                double b = d->raw[i].bias;
+                v[i] = b + ((double)d->raw[i].data[p] - b) * j->k[i];
+            }
+            double x = combinev(v, n) + 0.5;
+            d->data[p] = (x < 0.) ? 0 : (x > 65535.) ? 65535 : (uint16_t)x;
+        }
+    }
+    return NULL;
+}
+
+// build master dark of bucket `d` by its raw darks (scaled to exposition of newest)
+static void build_master(darkframe *d){
+    size_t S = d->W * d->H;
+    double t0 = dtime();
+    darkraw *last = &d->raw[d->nraw - 1];
+    d->exptime = last->exptime;
+    d->time = last->time;
+    FREE(d->data);
+    d->data = MALLOC(uint16_t, S);
+    if(d->nraw == 1){
+        memcpy(d->data, last->data, sizeof(uint16_t)*S);
+        d->bias = last->bias;
+        return;
+    }
+    combjob job = {.d = d, .S = S, .next = 0};
+    for(int i = 0; i < d->nraw; ++i) job.k[i] = d->exptime / d->raw[i].exptime;
+    long nthr = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthr < 1) nthr = 1;
+    else if(nthr > DARKLIB_MAXTHREADS) nthr = DARKLIB_MAXTHREADS;
+    pthread_t thr[DARKLIB_MAXTHREADS];
+    int started = 0;
+    for(int i = 1; i < nthr; ++i){
+        if(pthread_create(&thr[started], NULL, comb_thread, &job)) break;
+        ++started;
+    }
+    comb_thread(&job); // this thread works too
+    for(int i = 0; i < started; ++i) pthread_join(thr[i], NULL);
+    d->bias = darkbias(d->data, S);
+    DBG("Master dark of %d frames by %d threads: %.3fs", d->nraw, started + 1, dtime() - t0);
+    putlog("Master dark from %d frames built in %.3fs", d->nraw, dtime() - t0);
+}
+
+/**
+ * Put dark into library (replaces dark of the same bucket or the oldest one)
+ * @param dark     - dark image
+ * @param keepdata - ==1 to store copy of image data (else only time is stored)
+ */
+void darklib_put(imstorage *dark, int keepdata){
+    if(!dark || dark->exptime <= 0.) return;
+    if(keepdata && (!dark->imdata || dark->rowmask)) return; // partial dark is useless
+    int b = bucket(dark->exptime), idx = -1;
+    pthread_mutex_lock(&libmutex);
+    expire();
+    for(int i = 0; i < nlib; ++i){
+        if(lib[i].bucket == b && samegeom(&lib[i], dark)){
+            idx = i;
+            break;
+        }
+    }
+    if(idx < 0){
+        if(nlib < DARKLIB_MAX) idx = nlib++;
+        else{ // replace the oldest
+            idx = 0;
+            for(int i = 1; i < nlib; ++i)
+                if(lib[i].time < lib[idx].time) idx = i;
+        }
+    }
+    darkframe *d = &lib[idx];
+    if(d->bucket != b || !samegeom(d, dark)) freebucket(d); // new or replaced bucket
+    d->binning = dark->binning;
+    d->W = dark->W;
+    d->H = dark->H;
+    d->bucket = b;
+    d->exptime = dark->exptime;
+    d->time = (double)dark->exposetime;
+    d->bias = 0.;
+    if(keepdata){
+        size_t S = dark->W * dark->H;
+        // remove too old & extra darks from stack
+        int first = 0;
+        while(first < d->nraw && (d->time - d->raw[first].time > maxage || d->nraw - first >= nstack))
+            FREE(d->raw[first++].data);
+        if(first){
+            d->nraw -= first;
+            memmove(d->raw, d->raw + first, d->nraw * sizeof(darkraw));
+        }
+        darkraw *r = &d->raw[d->nraw++];
+        r->data = MALLOC(uint16_t, S);
+        memcpy(r->data, dark->imdata, sizeof(uint16_t)*S);
+        r->exptime = dark->exptime;
+        r->time = d->time;
+        r->bias = darkbias(r->data, S);
+        build_master(d);
+        hotpix_build(d->binning, d->W, d->H, d->data);
+    }
+    pthread_mutex_unlock(&libmutex);
+    putlog("Dark for %gs stored in bucket %d", dark->exptime, b);
+    event_post(EVENT_DARK, "\"exptime\":%g,\"bucket\":%d", dark->exptime, b);
+}
+
+/**
+ * Subtract dark from image: dark of the same bucket or the nearest fresh one
+ * (with exposition ratio not more than DARKLIB_MAXSCALE), scaled by exposition
+ * @return 0 if dark was subtracted
+ */
+int darklib_subtract(imstorage *img){
+    if(!img || !img->imdata || img->exptime <= 0.) return 1;
+    int b = bucket(img->exptime), ret = 1;
+    pthread_mutex_lock(&libmutex);
+    expire();
+    darkframe *d = NULL;
+    double best = log(DARKLIB_MAXSCALE);
+    for(int i = 0; i < nlib; ++i){
+        if(!lib[i].data || !samegeom(&lib[i], img)) continue;
+        if(lib[i].bucket == b){
+            d = &lib[i];
+            break;
+        }
+        double r = fabs(log(img->exptime / lib[i].exptime));
+        if(r <= best){
+            best = r;
+            d = &lib[i];
+        }
+    }
+    if(d){
+        double k = img->exptime / d->exptime, bias = d->bias;
+        uint16_t *iptr = img->imdata, *dptr = d->data;
+        size_t S = img->W * img->H;
+        for(size_t s = 0; s < S; ++s){
+            double v = (double)iptr[s] - (bias + ((double)dptr[s] - bias) * k);
+            iptr[s] = (v > 0.) ? (uint16_t)(v + 0.5) : 0;
+        }
+        putlog("Dark extracted (dark: %gs, image: %gs)", d->exptime, img->exptime);
+        ret = 0;
+    }else putlog("No dark for %gs image", img->exptime);
+    pthread_mutex_unlock(&libmutex);
+    return ret;
+}
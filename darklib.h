@@ -0,0 +1,56 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * darklib.h - library of dark frames
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __DARKLIB_H__
+#define __DARKLIB_H__
+
+#include "imfunctions.h"
+
+// maximal amount of darks in library
+#define DARKLIB_MAX         (16)
+// default maximal age of dark (seconds)
+#define DARKLIB_MAXAGE      (3600.)
+// maximal exposition ratio of image and dark from other bucket
+#define DARKLIB_MAXSCALE    (4.)
+// default & maximal amount of darks to build master dark
+#define DARKLIB_NSTACK      (8)
+#define DARKLIB_NSTACK_MAX  (32)
+// sigma-clipping: reject values deviating from median more than KAPPA*sigma
+// (sigma is 1.4826*MAD)
+#define DARKLIB_KAPPA       (3.)
+// pixels in tile processed by one thread at once
+#define DARKLIB_TILE        (4096)
+// maximal amount of threads building master dark
+#define DARKLIB_MAXTHREADS  (16)
+
+// master dark combining method
+typedef enum{
+    DARK_MEDIAN,
+    DARK_SIGCLIP
+} dark_combine;
+
+void darklib_setup(double maxage);
+int darklib_stacking(int n, const char *method);
+int darklib_stale(imstorage *img);
+void darklib_put(imstorage *dark, int keepdata);
+int darklib_subtract(imstorage *img);
+
+#endif // __DARKLIB_H__
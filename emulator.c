@@ -0,0 +1,536 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * emulator.c - SBIG all-sky 340 camera emulator on pseudo-terminal
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Emulator opens pseudo-terminal and prints name of its slave side, run
+ *      sbig340_standalone -i /dev/pts/N
+ * to work with it. Emulator understands all commands from term.h, simulates
+ * transfer time by current baudrate, exposition & readout delays and can
+ * damage data blocks to check resending.
+ */
+
+#include "chksum.h"
+#include "parseargs.h"
+#include "term.h"
+#include "usefull_macros.h"
+
+#include <math.h>    // sqrt, log
+#include <poll.h>
+#include <signal.h>
+
+/*
+ * Command line options
+ */
+typedef struct{
+    int speed;          // initial speed
+    double errprob;     // probability of block damage
+    int notiming;       // don't simulate transfer time
+    double readout;     // readout time of full frame
+    double statusper;   // period of status bytes sending
+    double sky;         // sky brightness, ADU per second
+    char *link;         // make symlink to slave pty
+    int verbose;        // show commands
+} emu_pars;
+
+static int help = 0;
+static emu_pars G = {
+    .speed = 9600,
+    .errprob = 0.,
+    .notiming = 0,
+    .readout = 1.5,
+    .statusper = 0.5,
+    .sky = 2000.,
+    .link = NULL,
+    .verbose = 0
+};
+
+static myoption cmdlnopts[] = {
+    {"help",    NO_ARGS,    NULL,   'h',    arg_int,    APTR(&help),        _("show this help")},
+    {"speed",   NEED_ARG,   NULL,   's',    arg_int,    APTR(&G.speed),     _("initial camera speed (default: 9600)")},
+    {"errors",  NEED_ARG,   NULL,   'e',    arg_double, APTR(&G.errprob),   _("probability of data block damage (0..1)")},
+    {"notiming",NO_ARGS,    NULL,   'n',    arg_int,    APTR(&G.notiming),  _("don't simulate transfer time")},
+    {"readout", NEED_ARG,   NULL,   'r',    arg_double, APTR(&G.readout),   _("full frame readout time, seconds (default: 1.5)")},
+    {"status",  NEED_ARG,   NULL,   'S',    arg_double, APTR(&G.statusper), _("period of exposition status bytes, seconds (default: 0.5)")},
+    {"sky",     NEED_ARG,   NULL,   'k',    arg_double, APTR(&G.sky),       _("sky brightness, ADU per second (default: 2000)")},
+    {"link",    NEED_ARG,   NULL,   'l',    arg_string, APTR(&G.link),      _("make symbolic link with given name to slave pty")},
+    {"verbose", NO_ARGS,    NULL,   'v',    arg_int,    APTR(&G.verbose),   _("show received commands")},
+   end_option
+};
+
+static const int speeds[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800};
+static const speed_t Bspeeds[] = {B9600, B19200, B38400, B57600, B115200, B230400, B460800};
+#define NSPEEDS ((int)(sizeof(speeds)/sizeof(speeds[0])))
+
+// camera states
+typedef enum{
+    ST_IDLE,        // wait for commands
+    ST_BAUD_S,      // speed changed, need to send 'S'
+    ST_BAUD_TEST,   // wait for "Test"
+    ST_BAUD_K,      // wait for 'k'
+    ST_EXPOSE,      // exposition in progress
+    ST_READOUT,     // readout in progress
+    ST_XFER         // image transfer
+} emu_state;
+
+static int master = -1, slave = -1;
+static int curspd = 0;          // index of camera speed
+static int oldspd = 0;          // speed before 'B' command
+static emu_state state = ST_IDLE;
+static double tevent = 0.;      // time of next state change
+static double tstatus = 0.;     // time of next status byte
+// output queue
+static uint8_t outbuf[65536];
+static size_t outlen = 0, outpos = 0;
+static double tout = 0.;        // time of last output portion
+// exposition parameters
+static double exptime = 0.;
+static int binning = 0, imtype = 1; // imtype: 0 - dark, 1 - light, 2 - autodark
+static int heaterstate = 0;
+static uint16_t subX = 0, subY = 0;
+static uint8_t subS = MAX_SUBFRAME_SZ;
+// image
+static uint16_t *image = NULL;
+static size_t imsize = 0, blksize = 0, blkpos = 0, curblk = 0; // sizes in bytes
+static size_t nblocks = 0, nresends = 0, ndamaged = 0;
+
+void signals(int sig){
+    if(G.link) unlink(G.link);
+    if(sig) printf(_("Exit with status %d\n"), sig);
+    exit(sig);
+}
+
+// pseudo-random numbers (xorshift)
+static uint64_t rndstate = 88172645463325252ULL;
+static uint64_t rnd(){
+    rndstate ^= rndstate << 13;
+    rndstate ^= rndstate >> 7;
+    rndstate ^= rndstate << 17;
+    return rndstate;
+}
+static double rnd01(){
+    return (rnd() >> 11) * (1. / 9007199254740992.);
+}
+// gaussian noise with given sigma
+static double gauss(double sigma){
+    double u = rnd01(), v = rnd01();
+    if(u < 1e-12) u = 1e-12;
+    return sigma * sqrt(-2.*log(u)) * cos(2.*M_PI*v);
+}
+
+/**
+ * @return speed of host side of terminal or -1
+ */
+static int host_speed(){
+    struct termios t;
+    if(tcgetattr(master, &t)) return -1; // for master pty it returns slave settings
+    speed_t s = cfgetospeed(&t);
+    for(int i = 0; i < NSPEEDS; ++i)
+        if(Bspeeds[i] == s) return i;
+    return -1;
+}
+
+// put data into output queue
+static void put(const uint8_t *data, size_t len){
+    if(outpos == outlen) outpos = outlen = 0;
+    if(outlen + len > sizeof(outbuf)){
+        WARNX(_("Output buffer overflow"));
+        return;
+    }
+    if(outpos == outlen) tout = mtime();
+    memcpy(outbuf + outlen, data, len);
+    outlen += len;
+}
+static void putbyte(uint8_t b){
+    put(&b, 1);
+}
+
+/**
+ * write data from output queue not faster than current speed allows
+ * @return time (seconds) till next portion could be written
+ */
+static double flush_out(){
+    if(outpos == outlen) return 1.;
+    size_t n = outlen - outpos;
+    if(!G.notiming){
+        double t = mtime();
+        size_t allowed = (size_t)((t - tout) * speeds[curspd] / 10.);
+        if(!allowed) return 10. / speeds[curspd];
+        if(allowed < n) n = allowed;
+    }
+    ssize_t w = write(master, outbuf + outpos, n);
+    if(w > 0){
+        outpos += w;
+        tout += 10. * w / speeds[curspd];
+    }
+    if(outpos == outlen) return 1.;
+    return 10. / speeds[curspd];
+}
+
+// generate image: sky with stars & dark current
+static void gen_image(){
+    size_t W, H;
+    switch(binning){
+        case 1: W = IM_CROPWIDTH; H = IMHEIGHT; blksize = 4096*2; break;
+        case 2: W = IMWIDTH/2; H = IMHEIGHT/2; blksize = 1024*2; break;
+        case 0xff: W = H = subS; blksize = subS*2; break;
+        default: W = IMWIDTH; H = IMHEIGHT; blksize = 4096*2;
+    }
+    imsize = W * H * 2;
+    FREE(image);
+    image = MALLOC(uint16_t, W*H);
+    double sky = (imtype == 0) ? 0. : G.sky * exptime, dark = 20. * exptime, bias = 500.;
+    if(binning == 2) sky *= 4.;
+    double cx = W/2., cy = H/2., R = (W < H ? W : H) / 2.;
+    for(size_t y = 0; y < H; ++y){
+        for(size_t x = 0; x < W; ++x){
+            double dx = (x - cx) / R, dy = (y - cy) / R, r2 = dx*dx + dy*dy;
+            double v = bias + dark + sky * (1. + 0.5*r2); // brighter to horizon
+            v += gauss(sqrt(v > 0. ? v : 0.) + 8.);
+            if(v < 0.) v = 0.;
+            else if(v > 65535.) v = 65535.;
+            image[y*W + x] = (uint16_t) v;
+        }
+    }
+    if(imtype){ // stars
+        for(int i = 0; i < 200; ++i){
+            size_t x = rnd() % W, y = rnd() % H;
+            double v = image[y*W + x] + G.sky * exptime * (1 + rnd() % 50);
+            image[y*W + x] = (v > 65535.) ? 65535 : (uint16_t)v;
+        }
+    }
+    blkpos = curblk = 0;
+}
+
+// send current data block (damage it with probability G.errprob)
+static void send_block(){
+    size_t l = imsize - blkpos;
+    if(l > blksize) l = blksize;
+    uint8_t *data = (uint8_t*)image + blkpos;
+    uint8_t cs = xor_chksum(data, l);
+    curblk = l;
+    if(G.errprob > 0. && rnd01() < G.errprob){
+        uint8_t *bad = MALLOC(uint8_t, l);
+        memcpy(bad, data, l);
+        bad[rnd() % l] ^= 1 << (rnd() % 8);
+        put(bad, l);
+        FREE(bad);
+        ++ndamaged;
+    }else put(data, l);
+    putbyte(cs);
+    ++nblocks;
+}
+
+// start transfer of data
+static void start_xfer(){
+    if(!image) gen_image();
+    blkpos = 0;
+    nblocks = nresends = ndamaged = 0;
+    state = ST_XFER;
+    send_block();
+}
+
+// process data transfer commands
+static void xfer_cmd(uint8_t c){
+    switch(c){
+        case IMTRANS_CONTINUE:
+            blkpos += curblk;
+            if(blkpos >= imsize){
+                state = ST_IDLE;
+                if(G.verbose) green("Transfer done: %zd blocks, %zd damaged, %zd resent\n",
+                                    nblocks, ndamaged, nresends);
+                return;
+            }
+            send_block();
+        break;
+        case IMTRANS_RESEND:
+            ++nresends;
+            send_block();
+        break;
+        case IMTRANS_STOP:
+            if(G.verbose) green("Transfer stopped\n");
+            state = ST_IDLE;
+        break;
+        default:
+            DBG("Unknown transfer command 0x%02x", c);
+    }
+}
+
+// length of command with its arguments (without checksum) or 0 for unknown
+static int cmdlen(uint8_t c){
+    switch(c){
+        case CMD_COMM_TEST:
+        case CMD_FIRMWARE_VERSION:
+        case CMD_SHUTTER_OPEN:
+        case CMD_SHUTTER_CLOSE:
+        case CMD_SHUTTER_DEENERGIZE:
+        case CMD_ABORT_IMAGE:
+        case CMD_XFER_IMAGE:
+            return 1;
+        case CMD_HEATER:
+        case CMD_CHANGE_BAUDRATE:
+            return 2;
+        case CMD_DEFINE_SUBFRAME:
+        case CMD_TAKE_IMAGE:
+            return 6;
+        default:
+            return 0;
+    }
+}
+
+// run command `cmd` of length `len`, `cs` is its checksum
+static void run_cmd(uint8_t *cmd, int len, uint8_t cs){
+    if(G.verbose){
+        printf("Command '%c'", cmd[0]);
+        for(int i = 1; i < len; ++i) printf(" %u", cmd[i]);
+        printf("\n");
+    }
+    if((state == ST_EXPOSE || state == ST_READOUT) && cmd[0] != CMD_ABORT_IMAGE){
+        putbyte(ANS_EXP_IN_PROGRESS); // busy
+        return;
+    }
+    putbyte(cs);
+    switch(cmd[0]){
+        case CMD_COMM_TEST:
+            putbyte(ANS_COMM_TEST);
+        break;
+        case CMD_FIRMWARE_VERSION:
+            putbyte(1); putbyte(10); // V1.10
+        break;
+        case CMD_HEATER:
+            heaterstate = cmd[1];
+            green("Heater %s\n", heaterstate ? "ON" : "OFF");
+        break;
+        case CMD_CHANGE_BAUDRATE:
+            if(cmd[1] < '0' || cmd[1] >= '0' + NSPEEDS) break;
+            oldspd = curspd;
+            curspd = cmd[1] - '0';
+            state = ST_BAUD_S;
+            tevent = mtime() + 0.05; // time to change UART speed
+            green("Change speed to %d\n", speeds[curspd]);
+        break;
+        case CMD_SHUTTER_OPEN:
+        case CMD_SHUTTER_CLOSE:
+        case CMD_SHUTTER_DEENERGIZE:
+            if(G.verbose) green("Shutter command %c\n", cmd[0]);
+        break;
+        case CMD_DEFINE_SUBFRAME:
+            subX = (cmd[1] << 8) | cmd[2];
+            subY = (cmd[3] << 8) | cmd[4];
+            subS = cmd[5];
+            green("Subframe: X=%u, Y=%u, size=%u\n", subX, subY, subS);
+        break;
+        case CMD_TAKE_IMAGE:
+            exptime = ((cmd[1] << 16) | (cmd[2] << 8) | cmd[3]) / 10000.;
+            binning = cmd[4];
+            imtype = cmd[5];
+            FREE(image);
+            state = ST_EXPOSE;
+            tstatus = mtime() + G.statusper;
+            tevent = mtime() + exptime;
+            green("Expose %gs, binning %d, type %d\n", exptime, binning, imtype);
+        break;
+        case CMD_ABORT_IMAGE:
+            if(state == ST_EXPOSE || state == ST_READOUT) green("Exposition aborted\n");
+            state = ST_IDLE;
+        break;
+        case CMD_XFER_IMAGE:
+            start_xfer();
+        break;
+    }
+}
+
+// process input data; @return amount of bytes used
+static size_t process(uint8_t *buf, size_t len){
+    size_t used = 0;
+    while(used < len){
+        uint8_t *ptr = buf + used;
+        size_t rest = len - used;
+        switch(state){
+            case ST_XFER:
+                xfer_cmd(*ptr);
+                ++used;
+                continue;
+            case ST_BAUD_S: // ignore all till 'S' sent
+                ++used;
+                continue;
+            case ST_BAUD_TEST:
+                if(rest < 4) return used;
+                if(memcmp(ptr, "Test", 4)){ ++used; continue; }
+                put((const uint8_t*)"TestOk", 6);
+                used += 4;
+                state = ST_BAUD_K;
+                tevent = mtime() + 1.;
+                continue;
+            case ST_BAUD_K:
+                ++used;
+                if(*ptr == 'k'){
+                    state = ST_IDLE;
+                    green("Speed changed\n");
+                }
+                continue;
+            default:
+            break;
+        }
+        int l = cmdlen(*ptr);
+        if(!l){ // garbage
+            DBG("Unknown byte 0x%02x", *ptr);
+            ++used;
+            continue;
+        }
+        if(rest < (size_t)l + 1) return used; // wait for the rest
+        uint8_t cs = 0;
+        for(int i = 0; i < l; ++i) cs ^= ~ptr[i] & 0x7f;
+        if(cs != ptr[l]){
+            DBG("Bad checksum");
+            putbyte(0x7f);
+            ++used;
+            continue;
+        }
+        run_cmd(ptr, l, cs);
+        used += l + 1;
+    }
+    return used;
+}
+
+// check timed events; @return time till next event
+static double timed_events(){
+    double t = mtime(), next = 1.;
+    switch(state){
+        case ST_BAUD_S:
+            if(t >= tevent){
+                putbyte(ANS_CHANGE_BAUDRATE);
+                state = ST_BAUD_TEST;
+                tevent = t + 1.;
+            }else next = tevent - t;
+        break;
+        case ST_BAUD_TEST:
+        case ST_BAUD_K:
+            if(t >= tevent){ // no answer - return old speed
+                WARNX(_("Speed change failed, return to %d"), speeds[oldspd]);
+                curspd = oldspd;
+                state = ST_IDLE;
+            }else next = tevent - t;
+        break;
+        case ST_EXPOSE:
+        case ST_READOUT:
+            if(t >= tevent){
+                if(state == ST_EXPOSE){
+                    double k = 1.;
+                    if(binning == 2) k = 0.25;
+                    else if(binning == 1) k = (double)IM_CROPWIDTH / IMWIDTH;
+                    else if(binning == 0xff) k = (double)subS*subS / (IMWIDTH*IMHEIGHT);
+                    state = ST_READOUT;
+                    tevent = t + G.readout * k;
+                    putbyte(ANS_RDOUT_IN_PROGRESS);
+                    tstatus = t + G.statusper;
+                }else{
+                    gen_image();
+                    state = ST_IDLE;
+                    putbyte(ANS_EXP_DONE);
+                    green("Image ready\n");
+                    break;
+                }
+            }
+            if(t >= tstatus){
+                putbyte(state == ST_EXPOSE ? ANS_EXP_IN_PROGRESS : ANS_RDOUT_IN_PROGRESS);
+                tstatus = t + G.statusper;
+            }
+            next = ((tevent < tstatus) ? tevent : tstatus) - t;
+        break;
+        default:
+        break;
+    }
+    return next;
+}
+
+static void open_pty(){
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0) ERR("posix_openpt()");
+    if(grantpt(master) || unlockpt(master)) ERR("grantpt()");
+    char *name = ptsname(master);
+    if(!name) ERR("ptsname()");
+    // hold slave opened, so master won't get POLLHUP when client disconnects
+    slave = open(name, O_RDWR | O_NOCTTY);
+    if(slave < 0) ERR(_("Can't open %s"), name);
+    struct termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    cfsetispeed(&t, Bspeeds[curspd]);
+    cfsetospeed(&t, Bspeeds[curspd]);
+    tcsetattr(slave, TCSANOW, &t);
+    int fl = fcntl(master, F_GETFL);
+    fcntl(master, F_SETFL, fl | O_NONBLOCK);
+    if(G.link){
+        unlink(G.link);
+        if(symlink(name, G.link)){
+            WARN(_("Can't make symlink %s"), G.link);
+            G.link = NULL;
+        }
+    }
+    printf("%s\n", name);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv){
+    initial_setup();
+    signal(SIGTERM, signals);
+    signal(SIGINT, signals);
+    signal(SIGQUIT, signals);
+    signal(SIGHUP, SIG_IGN);
+    change_helpstring("Usage: %s [args]\n\n\tWhere args are:\n");
+    parseargs(&argc, &argv, cmdlnopts);
+    if(help) showhelp(-1, cmdlnopts);
+    for(curspd = 0; curspd < NSPEEDS && speeds[curspd] != G.speed; ++curspd);
+    if(curspd == NSPEEDS) ERRX(_("Wrong speed: %d"), G.speed);
+    if(G.errprob < 0. || G.errprob > 1.) ERRX(_("Error probability should be in 0..1"));
+    setvbuf(stdout, NULL, _IOLBF, 0); // for logs through pipes
+    rndstate ^= (uint64_t)time(NULL);
+    open_pty();
+    uint8_t inbuf[1024];
+    size_t inlen = 0;
+    while(1){
+        double tmout = timed_events(), t = flush_out();
+        if(t < tmout) tmout = t;
+        struct pollfd pfd = {.fd = master, .events = POLLIN};
+        if(poll(&pfd, 1, (int)(tmout * 1000.) + 1) < 0){
+            if(errno == EINTR) continue;
+            ERR("poll()");
+        }
+        if(!(pfd.revents & POLLIN)) continue;
+        ssize_t L = read(master, inbuf + inlen, sizeof(inbuf) - inlen);
+        if(L < 1) continue;
+        int hs = host_speed();
+        if(hs != curspd && state != ST_BAUD_S){ // wrong speed - got garbage
+            DBG("Host speed %d, camera speed %d", hs < 0 ? 0 : speeds[hs], speeds[curspd]);
+            inlen = 0;
+            continue;
+        }
+        inlen += L;
+        size_t used = process(inbuf, inlen);
+        if(used == inlen) inlen = 0;
+        else if(used){
+            memmove(inbuf, inbuf + used, inlen - used);
+            inlen -= used;
+        }
+        if(inlen == sizeof(inbuf)) inlen = 0; // garbage
+    }
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * ephem.c - Sun & Moon positions and sky brightness model
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Low precision formulae of Astronomical Almanac: Sun position better than
+ * 0.01 degree, Moon - about 0.3 degree (parallax is ignored, so Moon altitude
+ * error is up to 1 degree), that's enough for sky brightness estimation.
+ * Sky brightness during twilight changes by a decade per 2..3 degrees of Sun
+ * altitude, so exposition of next frame is scaled by brightness ratio between
+ * moment when previous exposition was measured and the next frame.
+ */
+
+#include "ephem.h"
+#include "usefull_macros.h"
+
+#include <math.h>
+
+#define DEG2RAD(x)  ((x) * M_PI / 180.)
+#define RAD2DEG(x)  ((x) * 180. / M_PI)
+
+static double latitude = EPHEM_NOCOORD, longitude = EPHEM_NOCOORD;
+
+/**
+ * Set site coordinates
+ * @param lat - latitude (degrees, north is positive)
+ * @param lon - longitude (degrees, east is positive)
+ * @return 0 if all OK
+ */
+int ephem_setup(double lat, double lon){
+    if(lat == EPHEM_NOCOORD && lon == EPHEM_NOCOORD) return 0; // not used
+    if(lat < -90. || lat > 90.){
+        WARNX(_("Latitude should be in range -90..90 degrees"));
+        return 1;
+    }
+    if(lon < -180. || lon > 360.){
+        WARNX(_("Longitude should be in range -180..360 degrees"));
+        return 1;
+    }
+    latitude = lat;
+    longitude = lon;
+    return 0;
+}
+
+/**
+ * @return 1 if site coordinates are set
+ */
+int ephem_ready(){
+    return (latitude != EPHEM_NOCOORD && longitude != EPHEM_NOCOORD);
+}
+
+// reduce angle to 0..360
+static double norm360(double x){
+    x = fmod(x, 360.);
+    return (x < 0.) ? x + 360. : x;
+}
+
+// altitude (degrees) of object with given RA & Dec (degrees) for local sidereal time `lst`
+static double altitude(double ra, double dec, double lst){
+    double H = DEG2RAD(lst - ra), d = DEG2RAD(dec), f = DEG2RAD(latitude);
+    return RAD2DEG(asin(sin(f)*sin(d) + cos(f)*cos(d)*cos(H)));
+}
+
+// ecliptic -> equatorial coordinates (degrees)
+static void ecl2eq(double lambda, double beta, double eps, double *ra, double *dec){
+    double l = DEG2RAD(lambda), b = DEG2RAD(beta), e = DEG2RAD(eps);
+    *ra = norm360(RAD2DEG(atan2(sin(l)*cos(e) - tan(b)*sin(e), cos(l))));
+    *dec = RAD2DEG(asin(sin(b)*cos(e) + cos(b)*sin(e)*sin(l)));
+}
+
+/**
+ * Calculate Sun & Moon positions
+ * @param t     - UNIX time
+ * @param p (o) - positions
+ */
+void ephem_calc(double t, ephem_pos *p){
+    double n = t / 86400. - 10957.5; // days from J2000.0
+    double T = n / 36525.;
+    double eps = 23.439 - 0.0000004 * n;
+    // Sun
+    double g = DEG2RAD(norm360(357.528 + 0.9856003 * n));
+    double lsun = norm360(280.460 + 0.9856474 * n + 1.915 * sin(g) + 0.020 * sin(2.*g));
+    // Moon
+    #define S(a, b) sin(DEG2RAD(norm360((a) + (b) * T)))
+    double lmoon = norm360(218.32 + 481267.881 * T + 6.29 * S(135.0, 477198.87)
+                   - 1.27 * S(259.3, -413335.36) + 0.66 * S(235.7, 890534.22)
+                   + 0.21 * S(269.9, 954397.74) - 0.19 * S(357.5, 35999.05)
+                   - 0.11 * S(186.5, 966404.03));
+    double bmoon = 5.13 * S(93.3, 483202.02) + 0.28 * S(228.2, 960400.89)
+                   - 0.28 * S(318.3, 6003.15) - 0.17 * S(217.6, -407332.21);
+    #undef S
+    double lst = norm360(280.46061837 + 360.98564736629 * n + longitude);
+    double ra, dec;
+    ecl2eq(lsun, 0., eps, &ra, &dec);
+    p->sunalt = altitude(ra, dec, lst);
+    ecl2eq(lmoon, bmoon, eps, &ra, &dec);
+    p->moonalt = altitude(ra, dec, lst);
+    double cospsi = cos(DEG2RAD(lmoon - lsun)) * cos(DEG2RAD(bmoon)); // elongation
+    p->moonphase = (1. - cospsi) / 2.;
+}
+
+/**
+ * Sky brightness model
+ * @param t - UNIX time
+ * @return sky brightness (cd/m^2) or -1 if site coordinates not set
+ */
+double sky_brightness(double t){
+    // log10 of sky brightness by Sun altitude
+    static const double tbl[][2] = {
+        {-90., -3.7}, {-18., -3.7}, {-15., -3.3}, {-12., -2.5}, {-9., -1.3}, {-6., -0.2},
+        {-3., 1.0}, {0., 2.2}, {5., 3.2}, {10., 3.6}, {20., 3.8}, {90., 4.0}
+    };
+    if(!ephem_ready()) return -1.;
+    ephem_pos p;
+    ephem_calc(t, &p);
+    int i = 1, N = sizeof(tbl) / sizeof(tbl[0]);
+    while(i < N - 1 && tbl[i][0] < p.sunalt) ++i;
+    double lg = tbl[i-1][1] + (tbl[i][1] - tbl[i-1][1]) * (p.sunalt - tbl[i-1][0]) / (tbl[i][0] - tbl[i-1][0]);
+    double B = pow(10., lg);
+    // full Moon in zenith gives about 4e-3 cd/m^2, phase law is near to square of illuminated part
+    if(p.moonalt > 0.) B += 4e-3 * p.moonphase * p.moonphase * sin(DEG2RAD(p.moonalt));
+    return B;
+}
+
+/**
+ * Predict exposition by sky brightness changes
+ * @param E      - exposition calculated by image taken at `t0`
+ * @param t0     - UNIX time of middle of that image exposition
+ * @param t1     - UNIX time of next exposition start
+ * @param minexp, maxexp - limits of exposition
+ * @return exposition for image started at `t1` (or `E` if site coordinates not set)
+ */
+double ephem_exptime(double E, double t0, double t1, double minexp, double maxexp){
+    if(!ephem_ready() || E <= 0. || t0 <= 0.) return E;
+    double Bprev = sky_brightness(t0), Enew = E;
+    // brightness at the middle of new exposition, which depends on exposition itself
+    for(int i = 0; i < 3; ++i){
+        double r = Bprev / sky_brightness(t1 + Enew / 2.);
+        if(r > EPHEM_MAXRATIO) r = EPHEM_MAXRATIO;
+        else if(r < 1. / EPHEM_MAXRATIO) r = 1. / EPHEM_MAXRATIO;
+        Enew = E * r;
+        if(Enew < minexp) Enew = minexp;
+        else if(Enew > maxexp) Enew = maxexp;
+    }
+    if(fabs(Enew / E - 1.) > 0.05){
+        ephem_pos p;
+        ephem_calc(t1, &p);
+        putlog("Sun alt %.1f, Moon alt %.1f (phase %.2f): exposition %g -> %g",
+               p.sunalt, p.moonalt, p.moonphase, E, Enew);
+    }
+    return Enew;
+}
@@ -0,0 +1,43 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * ephem.h - Sun & Moon positions and sky brightness model
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __EPHEM_H__
+#define __EPHEM_H__
+
+// value of latitude/longitude meaning "not set"
+#define EPHEM_NOCOORD       (1000.)
+// maximal exposition change by sky brightness prediction (times)
+#define EPHEM_MAXRATIO      (100.)
+
+// Sun and Moon position for given time
+typedef struct{
+    double sunalt;      // Sun altitude (degrees)
+    double moonalt;     // Moon altitude (degrees)
+    double moonphase;   // illuminated part of Moon disk (0..1)
+} ephem_pos;
+
+int ephem_setup(double lat, double lon);
+int ephem_ready();
+void ephem_calc(double t, ephem_pos *p);
+double sky_brightness(double t);
+double ephem_exptime(double E, double t0, double t1, double minexp, double maxexp);
+
+#endif // __EPHEM_H__
@@ -0,0 +1,120 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * events.c - acquisition state events for web clients (server-sent events)
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#ifdef DAEMON
+
+/*
+ * Events are posted by acquisition & worker threads (in the same places they
+ * are logged) into ring of last EVENTS_RING events already formatted for
+ * "text/event-stream": numbered by `id`, named by `event`, `data` is JSON
+ * object with time of event (UNIX) and its parameters. Server is woken up by
+ * eventfd and gives new events to web clients; client reconnected with
+ * Last-Event-ID gets events it missed (if they are still in ring).
+ */
+
+#include "events.h"
+#include "usefull_macros.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static const char *names[EVENT_AMOUNT] = {
+    [EVENT_EXPOSURE] = "exposure",
+    [EVENT_READOUT] = "readout",
+    [EVENT_FRAME] = "frame",
+    [EVENT_HEATER] = "heater",
+    [EVENT_DARK] = "dark",
+    [EVENT_ERROR] = "error",
+};
+
+typedef struct{
+    uint64_t id;
+    size_t len;
+    char text[EVENT_LEN];
+} event;
+
+static event ring[EVENTS_RING];
+static uint64_t lastid = 0; // number of last event
+static int evfd = -1;
+static pthread_mutex_t evmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Create eventfd signalled by each new event
+ * @return its descriptor or -1
+ */
+int events_init(){
+    if(evfd < 0 && (evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) WARN("eventfd()");
+    return evfd;
+}
+
+/**
+ * Post event `t` with parameters: JSON object members given by `fmt`
+ */
+void event_post(event_type t, const char *fmt, ...){
+    if(t >= EVENT_AMOUNT) return;
+    char data[EVENT_LEN - 128]; // the rest is for id, name & time
+    va_list ar;
+    va_start(ar, fmt);
+    vsnprintf(data, sizeof(data), fmt, ar);
+    va_end(ar);
+    pthread_mutex_lock(&evmutex);
+    event *e = &ring[(lastid + 1) % EVENTS_RING];
+    e->id = ++lastid;
+    int L = snprintf(e->text, EVENT_LEN, "id: %llu\nevent: %s\ndata: {\"time\":%.3f%s%s}\n\n",
+                     (unsigned long long)e->id, names[t], dtime(), *data ? "," : "", data);
+    e->len = (L < EVENT_LEN) ? (size_t)L : EVENT_LEN - 1;
+    pthread_mutex_unlock(&evmutex);
+    uint64_t one = 1;
+    if(evfd > -1 && sizeof(one) != write(evfd, &one, sizeof(one))) WARN("write(eventfd)");
+}
+
+// @return number of last event
+uint64_t events_last(){
+    pthread_mutex_lock(&evmutex);
+    uint64_t id = lastid;
+    pthread_mutex_unlock(&evmutex);
+    return id;
+}
+
+/**
+ * Get text of events after `*since` (events went out of ring are skipped)
+ * @param since (io) - number of last event client got
+ * @param buf, buflen - buffer for events
+ * @return length of data in `buf`
+ */
+size_t events_get(uint64_t *since, char *buf, size_t buflen){
+    size_t L = 0;
+    pthread_mutex_lock(&evmutex);
+    uint64_t id = *since + 1, oldest = (lastid > EVENTS_RING) ? lastid - EVENTS_RING + 1 : 1;
+    if(id < oldest) id = oldest;
+    for(; id <= lastid; ++id){
+        event *e = &ring[id % EVENTS_RING];
+        if(L + e->len > buflen) break;
+        memcpy(buf + L, e->text, e->len);
+        L += e->len;
+        *since = id;
+    }
+    pthread_mutex_unlock(&evmutex);
+    return L;
+}
+
+#endif // DAEMON
@@ -0,0 +1,55 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * events.h - acquisition state events for web clients (server-sent events)
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __EVENTS_H__
+#define __EVENTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// amount of last events kept for clients
+#define EVENTS_RING     (256)
+// maximal length of one event (SSE text)
+#define EVENT_LEN       (512)
+// idle events stream gets comment after this time (seconds)
+#define EVENTS_PING     (15.)
+
+typedef enum{
+    EVENT_EXPOSURE,     // exposition started
+    EVENT_READOUT,      // image transfer started
+    EVENT_FRAME,        // image published
+    EVENT_HEATER,       // heater turned on/off
+    EVENT_DARK,         // dark image taken
+    EVENT_ERROR,
+    EVENT_AMOUNT
+} event_type;
+
+#ifdef DAEMON
+int events_init();
+void event_post(event_type t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+uint64_t events_last();
+size_t events_get(uint64_t *since, char *buf, size_t buflen);
+#else
+// only daemon has clients for events
+#define event_post(...)    do{}while(0)
+#endif
+
+#endif // __EVENTS_H__
@@ -0,0 +1,232 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * hotpix.c - hot pixels map & correction
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Map of hot pixels is built by each new master dark: pixels with level above
+ * median + HOTPIX_NSIGMA*sigma (sigma is estimated by median absolute
+ * deviation) are stored as sorted list of indexes. Hot pixel is replaced by
+ * median of its same colour (for BGGR matrix) neighbours: +-2 pixels by X
+ * and Y, hot neighbours and neighbours in lost rows are skipped.
+ * Maps could be saved into file (text: header "W H binning N" and N indexes
+ * for each map) to be used by next runs.
+ * Maps are rebuilt by daemon's pipeline worker while sender threads correct
+ * products, so all access to them is done under mapmutex.
+ */
+
+#include <pthread.h>
+
+#include "hotpix.h"
+#include "usefull_macros.h"
+
+typedef struct{
+    int binning;
+    size_t W, H;
+    uint32_t *idx;      // sorted indexes of hot pixels
+    size_t N;           // amount of hot pixels
+    uint8_t *bits;      // bitmap of hot pixels (for neighbours check)
+} hotmap;
+
+static hotmap maps[HOTPIX_MAXMAPS];
+static int nmaps = 0;
+static char *mapfile = NULL;
+static pthread_mutex_t mapmutex = PTHREAD_MUTEX_INITIALIZER;
+
+// find map for given geometry (call with locked mapmutex)
+static hotmap *findmap(int binning, size_t W, size_t H){
+    for(int i = 0; i < nmaps; ++i)
+        if(maps[i].binning == binning && maps[i].W == W && maps[i].H == H) return &maps[i];
+    return NULL;
+}
+
+// get map for given geometry (new or oldest one is cleared; call with locked mapmutex)
+static hotmap *getmap(int binning, size_t W, size_t H){
+    hotmap *m = findmap(binning, W, H);
+    if(!m){
+        if(nmaps < HOTPIX_MAXMAPS) m = &maps[nmaps++];
+        else{ // replace the first one
+            FREE(maps[0].idx);
+            FREE(maps[0].bits);
+            memmove(maps, maps + 1, (HOTPIX_MAXMAPS - 1) * sizeof(hotmap));
+            m = &maps[HOTPIX_MAXMAPS - 1];
+        }
+        memset(m, 0, sizeof(hotmap));
+    }
+    FREE(m->idx);
+    FREE(m->bits);
+    m->binning = binning;
+    m->W = W;
+    m->H = H;
+    m->N = 0;
+    m->bits = MALLOC(uint8_t, (W*H + 7) / 8);
+    return m;
+}
+
+static void setbit(hotmap *m, size_t i){
+    m->bits[i >> 3] |= 1 << (i & 7);
+}
+static int getbit(const hotmap *m, size_t i){
+    return m->bits[i >> 3] & (1 << (i & 7));
+}
+
+// save all maps into mapfile (call with locked mapmutex)
+static void savemaps(){
+    if(!mapfile) return;
+    FILE *f = fopen(mapfile, "w");
+    if(!f){
+        WARN(_("Can't open %s"), mapfile);
+        return;
+    }
+    for(int i = 0; i < nmaps; ++i){
+        hotmap *m = &maps[i];
+        fprintf(f, "%zd %zd %d %zd\n", m->W, m->H, m->binning, m->N);
+        for(size_t j = 0; j < m->N; ++j) fprintf(f, "%u\n", m->idx[j]);
+    }
+    fclose(f);
+}
+
+/**
+ * Set file for hot pixels maps & load them from it (if it exists)
+ * @return 0 if all OK
+ */
+int hotpix_setup(const char *filename){
+    if(!filename) return 0;
+    FREE(mapfile);
+    mapfile = strdup(filename);
+    FILE *f = fopen(filename, "r");
+    if(!f) return 0; // will be created after first dark
+    size_t W, H, N;
+    int binning, ret = 0;
+    pthread_mutex_lock(&mapmutex);
+    while(4 == fscanf(f, "%zd %zd %d %zd", &W, &H, &binning, &N)){
+        if(!W || !H || N > W*H){
+            ret = 1;
+            break;
+        }
+        hotmap *m = getmap(binning, W, H);
+        m->idx = MALLOC(uint32_t, N ? N : 1);
+        for(; m->N < N; ++m->N){
+            uint32_t i;
+            if(1 != fscanf(f, "%u", &i) || i >= W*H || (m->N && i <= m->idx[m->N-1])) break;
+            m->idx[m->N] = i;
+            setbit(m, i);
+        }
+        if(m->N != N){
+            ret = 1;
+            break;
+        }
+        DBG("Load map %zdx%zd, %zd hot pixels", W, H, N);
+    }
+    pthread_mutex_unlock(&mapmutex);
+    if(!ret && !feof(f)) ret = 1;
+    fclose(f);
+    if(ret) WARNX(_("Bad hot pixels file %s"), filename);
+    return ret;
+}
+
+/**
+ * Build hot pixels map by dark
+ * @param binning, W, H - image geometry
+ * @param dark - master dark data
+ */
+void hotpix_build(int binning, size_t W, size_t H, const uint16_t *dark){
+    if(!dark || !W || !H) return;
+    size_t S = W*H, *hist = MALLOC(size_t, 65536), acc = 0;
+    for(size_t i = 0; i < S; ++i) ++hist[dark[i]];
+    int med = 0;
+    for(; med < 65535; ++med){
+        acc += hist[med];
+        if(acc > S/2) break;
+    }
+    // MAD by histogram: count pixels in |v - med| <= d while it less than S/2
+    acc = hist[med];
+    int d = 0;
+    while(acc <= S/2 && d < 65535){
+        ++d;
+        if(med - d >= 0) acc += hist[med - d];
+        if(med + d < 65536) acc += hist[med + d];
+    }
+    int exc = (int)(HOTPIX_NSIGMA * 1.4826 * d);
+    if(exc < HOTPIX_MINEXCESS) exc = HOTPIX_MINEXCESS;
+    int thres = med + exc;
+    // not more than HOTPIX_MAXPART: raise threshold
+    size_t maxN = (size_t)(HOTPIX_MAXPART * S), N = 0;
+    for(int l = 65535; l > thres; --l){
+        if(N + hist[l] > maxN){
+            thres = l;
+            break;
+        }
+        N += hist[l];
+    }
+    FREE(hist);
+    pthread_mutex_lock(&mapmutex);
+    hotmap *m = getmap(binning, W, H);
+    m->idx = MALLOC(uint32_t, N ? N : 1);
+    for(size_t i = 0; i < S; ++i){
+        if(dark[i] <= thres) continue;
+        m->idx[m->N++] = (uint32_t)i;
+        setbit(m, i);
+    }
+    putlog("Hot pixels map %zdx%zd: %zd pixels (median %d, threshold %d)", W, H, m->N, med, thres);
+    savemaps();
+    pthread_mutex_unlock(&mapmutex);
+}
+
+/**
+ * Replace hot pixels of image by median of same colour neighbours (the nearest
+ * ones for monochrome binned image)
+ * @return amount of corrected pixels
+ */
+size_t hotpix_correct(imstorage *img){
+    if(!img || !img->imdata) return 0;
+    pthread_mutex_lock(&mapmutex);
+    hotmap *m = findmap(img->binning, img->W, img->H);
+    if(!m || !m->N){
+        pthread_mutex_unlock(&mapmutex);
+        return 0;
+    }
+    static const int dx[8] = {-1, 0, 1, -1, 1, -1, 0, 1}, dy[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+    long step = colour_step(img->binning);
+    size_t W = img->W, H = img->H, corrected = 0;
+    uint16_t *data = img->imdata;
+    for(size_t n = 0; n < m->N; ++n){
+        size_t i = m->idx[n], x = i % W, y = i / W;
+        if(img->rowmask && !img->rowmask[y]) continue;
+        uint16_t v[8];
+        int nv = 0;
+        for(int k = 0; k < 8; ++k){
+            long X = (long)x + step*dx[k], Y = (long)y + step*dy[k];
+            if(X < 0 || Y < 0 || X >= (long)W || Y >= (long)H) continue;
+            if(img->rowmask && !img->rowmask[Y]) continue;
+            size_t j = Y*W + X;
+            if(getbit(m, j)) continue;
+            // insertion into sorted
+            uint16_t val = data[j];
+            int p = nv++;
+            for(; p > 0 && v[p-1] > val; --p) v[p] = v[p-1];
+            v[p] = val;
+        }
+        if(!nv) continue;
+        data[i] = (nv & 1) ? v[nv/2] : (uint16_t)(((uint32_t)v[nv/2-1] + v[nv/2] + 1) / 2);
+        ++corrected;
+    }
+    pthread_mutex_unlock(&mapmutex);
+    return corrected;
+}
@@ -0,0 +1,40 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * hotpix.h - hot pixels map & correction
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __HOTPIX_H__
+#define __HOTPIX_H__
+
+#include "imfunctions.h"
+
+// maximal amount of maps (different image geometries)
+#define HOTPIX_MAXMAPS      (4)
+// pixel is hot if its dark level is more than median + NSIGMA*sigma
+#define HOTPIX_NSIGMA       (5.)
+// ... and more than median + MINEXCESS
+#define HOTPIX_MINEXCESS    (50)
+// maximal part of hot pixels
+#define HOTPIX_MAXPART      (0.01)
+
+int hotpix_setup(const char *filename);
+void hotpix_build(int binning, size_t W, size_t H, const uint16_t *dark);
+size_t hotpix_correct(imstorage *img);
+
+#endif // __HOTPIX_H__
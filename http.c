@@ -0,0 +1,207 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * http.c - HTTP/1.1 requests parsing & answers headers
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#ifdef DAEMON
+
+/*
+ * Only what web clients of daemon need: GET, HEAD & POST with
+ * Content-Length, persistent connections (default for HTTP/1.1, by
+ * "Connection: keep-alive" for HTTP/1.0) and If-None-Match for images
+ * with ETag.
+ */
+
+#include "http.h"
+#include "usefull_macros.h"
+
+#include <strings.h> // strncasecmp
+
+static const struct{
+    const char *name;
+    http_method method;
+} methods[] = {
+    {"GET ", HTTP_GET},
+    {"HEAD ", HTTP_HEAD},
+    {"POST ", HTTP_POST},
+};
+#define NMETHODS    (sizeof(methods) / sizeof(methods[0]))
+
+/**
+ * Check whether data from client is HTTP request
+ * @return 1 if it is, 0 if not, -1 if there's not enough data to decide
+ */
+int http_isreq(const char *buf, size_t len){
+    for(size_t i = 0; i < NMETHODS; ++i){
+        size_t L = strlen(methods[i].name);
+        if(0 == strncmp(buf, methods[i].name, len < L ? len : L)) return (len < L) ? -1 : 1;
+    }
+    return 0;
+}
+
+// @return length of headers (with empty line after them) or 0 if they aren't full
+static size_t hdrlen(const char *buf, size_t len){
+    const char *e = memmem(buf, len, "\r\n\r\n", 4);
+    if(e) return e - buf + 4;
+    e = memmem(buf, len, "\n\n", 2);
+    if(e) return e - buf + 2;
+    return 0;
+}
+
+/**
+ * Find value of header `name` in headers `buf` of length `len`
+ * @param vlen (o) - length of value
+ * @return pointer to value (not terminated by zero) or NULL
+ */
+static const char *header(const char *buf, size_t len, const char *name, size_t *vlen){
+    size_t L = strlen(name);
+    const char *end = buf + len, *line = memchr(buf, '\n', len); // skip request line
+    while(line && ++line < end){
+        const char *eol = memchr(line, '\n', end - line);
+        if(!eol) eol = end;
+        if((size_t)(eol - line) > L && line[L] == ':' && 0 == strncasecmp(line, name, L)){
+            const char *v = line + L + 1, *ve = eol;
+            while(v < ve && (*v == ' ' || *v == '\t')) ++v;
+            while(ve > v && (ve[-1] == '\r' || ve[-1] == ' ' || ve[-1] == '\t')) --ve;
+            *vlen = ve - v;
+            return v;
+        }
+        line = (eol < end) ? eol : NULL;
+    }
+    return NULL;
+}
+
+// @return value of Content-Length (not more than `max + 1`) or 0
+static size_t contlen(const char *buf, size_t len, size_t max){
+    size_t vlen;
+    const char *v = header(buf, len, "Content-Length", &vlen);
+    if(!v) return 0;
+    size_t l = 0;
+    for(; vlen && *v >= '0' && *v <= '9' && l <= max; ++v, --vlen) l = l * 10 + (*v - '0');
+    return (l > max) ? max + 1 : l;
+}
+
+/**
+ * Check whether request in `buf` is full
+ * @param maxlen - max length of request (size of buffer)
+ * @return length of request (headers & body), 0 if it isn't full yet or
+ *      HTTP_TOOLONG if its headers or body declared by them are longer than `maxlen`
+ */
+size_t http_reqlen(const char *buf, size_t len, size_t maxlen){
+    size_t L = hdrlen(buf, len);
+    if(!L) return (len < maxlen) ? 0 : HTTP_TOOLONG;
+    if(L > maxlen) return HTTP_TOOLONG;
+    size_t B = contlen(buf, L, maxlen - L);
+    if(B > maxlen - L) return HTTP_TOOLONG;
+    L += B;
+    return (L <= len) ? L : 0;
+}
+
+/**
+ * Parse full request `buf` of length `len` (got by http_reqlen())
+ * @return 0 if all OK
+ */
+int http_parse(const char *buf, size_t len, httpreq *r){
+    memset(r, 0, sizeof(httpreq));
+    size_t i = 0;
+    for(; i < NMETHODS; ++i)
+        if(0 == strncmp(buf, methods[i].name, strlen(methods[i].name))) break;
+    if(i == NMETHODS) return 1;
+    r->method = methods[i].method;
+    size_t H = hdrlen(buf, len);
+    const char *eol = memchr(buf, '\n', len), *p = buf + strlen(methods[i].name);
+    while(p < eol && *p == ' ') ++p;
+    if(p >= eol || *p != '/') return 1;
+    const char *pe = memchr(p, ' ', eol - p);
+    if(!pe || (size_t)(pe - p) > HTTP_PATHLEN) return 1;
+    memcpy(r->path, p + 1, pe - p - 1);
+    r->keepalive = (0 == strncmp(pe + 1, "HTTP/1.1", 8));
+    size_t vlen;
+    const char *v = header(buf, H, "Connection", &vlen);
+    if(v){
+        if(vlen >= 5 && 0 == strncasecmp(v, "close", 5)) r->keepalive = 0;
+        else if(vlen >= 10 && 0 == strncasecmp(v, "keep-alive", 10)) r->keepalive = 1;
+    }
+    v = header(buf, H, "If-None-Match", &vlen);
+    if(v && vlen < HTTP_PATHLEN) memcpy(r->inm, v, vlen);
+    r->lastevent = -1;
+    v = header(buf, H, "Last-Event-ID", &vlen);
+    if(v && vlen && *v >= '0' && *v <= '9') r->lastevent = strtoll(v, NULL, 10);
+    r->bodylen = len - H;
+    r->body = r->bodylen ? buf + H : NULL;
+    return 0;
+}
+
+static const char *reason(int status){
+    switch(status){
+        case 200: return "OK";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 413: return "Request Entity Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+/**
+ * Make header of answer (for request `r`, or for non-HTTP client if it's NULL)
+ * @return length of header or -1
+ */
+int http_hdr(char *buf, size_t buflen, const httpreq *r, int status, const char *conttype, size_t contlen){
+    int keep = r && r->keepalive;
+    int L = snprintf(buf, buflen,
+        "HTTP/1.1 %d %s\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Access-Control-Allow-Methods: GET, HEAD, POST\r\n"
+        "Access-Control-Allow-Credentials: true\r\n", status, reason(status));
+    if(L < 0 || (size_t)L >= buflen) return -1;
+    int l = 0;
+    if(r && *r->etag) // images are revalidated by every request
+        l = snprintf(buf + L, buflen - L, "ETag: %s\r\nCache-Control: no-cache\r\n", r->etag);
+    else
+        l = snprintf(buf + L, buflen - L, "Cache-Control: no-store\r\n");
+    if(l < 0 || (size_t)(L += l) >= buflen) return -1;
+    if(keep) l = snprintf(buf + L, buflen - L, "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n", HTTP_KEEPALIVE);
+    else l = snprintf(buf + L, buflen - L, "Connection: close\r\n");
+    if(l < 0 || (size_t)(L += l) >= buflen) return -1;
+    if(conttype && contlen == HTTP_NOLENGTH) l = snprintf(buf + L, buflen - L, "Content-Type: %s\r\n\r\n", conttype);
+    else if(conttype) l = snprintf(buf + L, buflen - L, "Content-Type: %s\r\nContent-Length: %zd\r\n\r\n", conttype, contlen);
+    else l = snprintf(buf + L, buflen - L, "\r\n"); // 304
+    if(l < 0 || (size_t)(L += l) >= buflen) return -1;
+    return L;
+}
+
+/**
+ * @return 1 if client already has answer with ETag r->etag
+ */
+int http_notmodified(const httpreq *r){
+    if(!r || !*r->inm || !*r->etag) return 0;
+    size_t L = strlen(r->etag);
+    const char *p = r->inm;
+    while(*p){ // comma-separated list of (maybe weak) tags or "*"
+        while(*p == ' ' || *p == ',') ++p;
+        if(*p == '*') return 1;
+        if(0 == strncmp(p, "W/", 2)) p += 2;
+        if(0 == strncmp(p, r->etag, L) && (!p[L] || p[L] == ',' || p[L] == ' ')) return 1;
+        while(*p && *p != ',') ++p;
+    }
+    return 0;
+}
+
+#endif // DAEMON
@@ -0,0 +1,60 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * http.h - HTTP/1.1 requests parsing & answers headers
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+// idle keep-alive connection is closed after this time (seconds)
+#define HTTP_KEEPALIVE  (15)
+#define HTTP_PATHLEN    (256)
+#define HTTP_ETAGLEN    (64)
+// length of answer which lasts till connection close (event stream)
+#define HTTP_NOLENGTH   ((size_t)-1)
+// length of request which can't be placed into buffer
+#define HTTP_TOOLONG    ((size_t)-1)
+
+typedef enum{
+    HTTP_GET,
+    HTTP_HEAD,
+    HTTP_POST
+} http_method;
+
+// parsed request & parameters of answer
+typedef struct{
+    http_method method;
+    int keepalive;              // don't close connection after answer
+    char path[HTTP_PATHLEN];    // path without leading slash (with query)
+    const char *body;           // request body (POST) or NULL
+    size_t bodylen;
+    char inm[HTTP_PATHLEN];     // If-None-Match content
+    long long lastevent;        // Last-Event-ID or -1
+    char etag[HTTP_ETAGLEN];    // ETag of answer (empty if none)
+} httpreq;
+
+int http_isreq(const char *buf, size_t len);
+size_t http_reqlen(const char *buf, size_t len, size_t maxlen);
+int http_parse(const char *buf, size_t len, httpreq *r);
+int http_hdr(char *buf, size_t buflen, const httpreq *r, int status, const char *conttype, size_t contlen);
+int http_notmodified(const httpreq *r);
+
+#endif // __HTTP_H__
@@ -21,6 +21,9 @@
  *
  */
 
+#include "autoexp.h"
+#include "darklib.h"
+#include "hotpix.h"
 #include "imfunctions.h"
 #include "term.h"
 #include "usefull_macros.h"
@@ -28,10 +31,11 @@
 #include <fcntl.h>   // AT_...
 #include <libgen.h>  // basename
 #include <math.h>    // sqrt
+#include <pthread.h>
 #include <strings.h> // strncasecmp
 #include <sys/stat.h> // utimensat
 
-#ifndef DAEMON
+#if !defined DAEMON || defined PRODUCTS
 #ifdef LIBRAW
 #include "debayer.h"
 #endif // LIBRAW
@@ -41,14 +45,44 @@
 #ifdef LIBTIFF
 #include <tiffio.h>  // save tiff
 #endif // LIBTIFF
-#endif // !DAEMON
+#endif // !DAEMON || PRODUCTS
+
+// optimal exposition (calculated in histogram saver) & UNIX time of middle of
+// exposition by which it was got; they are changed together by worker thread
+static double exp_calculated = -1., exp_calctime = -1.;
+static pthread_mutex_t exp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get last calculated optimal exposition
+ * @param exptime (o) - exposition time
+ * @param calctime (o) - UNIX time of exposition it was calculated by
+ * @return 0 if there's no calculated exposition yet
+ */
+int get_exp_calculated(double *exptime, double *calctime){
+    pthread_mutex_lock(&exp_mutex);
+    *exptime = exp_calculated;
+    *calctime = exp_calctime;
+    pthread_mutex_unlock(&exp_mutex);
+    return (*exptime > 0.);
+}
 
-double exp_calculated = -1.; // optimal exposition, calculated in histogram saver
 /**
  * All image-storing functions modify ctime of saved files to be the time of
  * exposition start!
  */
-#ifndef DAEMON
+#if !defined DAEMON || defined PRODUCTS
+
+/**
+ * Change mtime of `filename` to time of exposition start
+ */
+void modifytimestamp(const char *filename, imstorage *img){
+    if(!filename) return;
+    struct timespec times[2];
+    memset(times, 0, 2*sizeof(struct timespec));
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = img->exposetime; // change mtime
+    if(utimensat(AT_FDCWD, filename, times, 0)) WARN(_("Can't change timestamp for %s"), filename);
+}
 
 /**
  * NON THREAD-SAFE!
@@ -222,7 +256,114 @@ int writetiff(imstorage *img){
     return 0;
 }
 #endif // LIBTIFF
-#endif // !DAEMON
+#endif // !DAEMON || PRODUCTS
+
+// statistics of image (full or collected by blocks during transfer)
+typedef struct{
+    const uint16_t *data;   // image data this statistics belongs to
+    size_t N;               // amount of pixels processed
+    size_t Noverld;         // amount of overloaded pixels
+    uint16_t min, max;
+    double sum, sum2;
+    size_t histogram[256];  // truncated to 256 levels histogram
+} imstat;
+// statistics collected by blocks (image could be processed in other thread)
+static imstat curstat;
+static pthread_mutex_t stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void stat_reset(imstat *st, const uint16_t *data){
+    memset(st, 0, sizeof(imstat));
+    st->data = data;
+    st->min = 65535;
+}
+
+static void stat_add(imstat *st, const uint16_t *ptr, size_t npix){
+    double sum = 0., sum2 = 0.;
+    uint16_t max = st->max, min = st->min;
+    size_t Noverld = 0;
+    for(size_t i = 0; i < npix; ++i){
+        uint16_t val = ptr[i];
+        double pv = (double) val;
+        sum += pv;
+        sum2 += (pv * pv);
+        if(max < val) max = val;
+        if(min > val) min = val;
+        if(val >= 65530) Noverld++;
+        ++st->histogram[val >> 8];
+    }
+    st->sum += sum; st->sum2 += sum2;
+    st->max = max; st->min = min;
+    st->Noverld += Noverld;
+    st->N += npix;
+}
+
+/**
+ * Calculate statistics by blocks while image transferring (block_consumer for get_image)
+ */
+void stat_block_consumer(imstorage _U_ *img, const uint16_t *data, size_t offset, size_t npix, void _U_ *arg){
+    pthread_mutex_lock(&stat_mutex);
+    if(!offset) stat_reset(&curstat, data);
+    if(curstat.data + curstat.N == data) stat_add(&curstat, data, npix);
+    // else lost block - will recalculate after
+    pthread_mutex_unlock(&stat_mutex);
+}
+
+/**
+ * Forget collected statistics (call it when image data changed in the same buffer)
+ */
+void forget_stat(){
+    pthread_mutex_lock(&stat_mutex);
+    curstat.data = NULL;
+    pthread_mutex_unlock(&stat_mutex);
+}
+
+/**
+ * Get statistics for whole `img` (calculate it if absent), rows lost in
+ * partial image are excluded
+ * @param st (o) - statistics
+ * @return st
+ */
+static imstat *get_stat(imstorage *img, imstat *st){
+    size_t size = (img->H - img->badrows) * img->W;
+    pthread_mutex_lock(&stat_mutex);
+    int have = (curstat.data == img->imdata && curstat.N == size);
+    if(have) memcpy(st, &curstat, sizeof(imstat));
+    pthread_mutex_unlock(&stat_mutex);
+    if(have) return st;
+    DBG("Calculate statistics");
+    stat_reset(st, img->imdata);
+    if(!img->rowmask) stat_add(st, img->imdata, size);
+    else for(size_t y = 0; y < img->H; ++y)
+        if(img->rowmask[y]) stat_add(st, img->imdata + y*img->W, img->W);
+    pthread_mutex_lock(&stat_mutex);
+    // save it for next calls if there's no transfer of other image
+    if(!curstat.data || curstat.data == img->imdata) memcpy(&curstat, st, sizeof(imstat));
+    pthread_mutex_unlock(&stat_mutex);
+    return st;
+}
+
+/**
+ * Get short statistics of image (for daemon's events)
+ */
+void get_imstats(imstorage *img, imstats *s){
+    imstat stat, *st = get_stat(img, &stat);
+    memset(s, 0, sizeof(imstats));
+    if(!st->N) return;
+    s->min = st->min;
+    s->max = st->max;
+    s->mean = st->sum / st->N;
+    double d = st->sum2 / st->N - s->mean * s->mean;
+    s->std = (d > 0.) ? sqrt(d) : 0.;
+    s->noverld = st->Noverld;
+}
+
+/**
+ * Pixels step between neighbours of the same colour: binned image is
+ * monochrome, others have Bayer matrix
+ */
+int colour_step(int binning){
+    return (binning == 2) ? 1 : 2;
+}
 
 /**
  * Calculate image statistics: print it on screen and save for `writefits`
@@ -230,21 +371,18 @@ int writetiff(imstorage *img){
 static uint16_t glob_min, glob_max, glob_avr, glob_std;
 void print_stat(imstorage *img){
     size_t size = img->W*img->H, i, Noverld = 0L, N = 0L;
-    double pv, sum=0., sum2=0., sz = (double)size, tres;
-    uint16_t *ptr = img->imdata, val, valoverld;
-    uint16_t max = 0, min = 65535;
-    valoverld = 65530;
-    for(i = 0; i < size; i++, ptr++){
-        val = *ptr;
-        pv = (double) val;
-        sum += pv;
-        sum2 += (pv * pv);
-        if(max < val) max = val;
-        if(min > val) min = val;
-        if(val >= valoverld) Noverld++;
+    double pv, sum, sum2, sz = (double)size, tres;
+    uint16_t *ptr, val;
+    imstat stat, *st = get_stat(img, &stat);
+    uint16_t max = st->max, min = st->min;
+    Noverld = st->Noverld;
+    if(img->rowmask){
+        printf(_("Partial image: %zd rows lost\n"), img->badrows);
+        sz = (double)st->N;
+        if(!st->N) return;
     }
     printf(_("Image stat:\n"));
-    double avr = sum/sz, std = sqrt(fabs(sum2/sz - avr*avr));
+    double avr = st->sum/sz, std = sqrt(fabs(st->sum2/sz - avr*avr));
     glob_avr = avr, glob_std = std, glob_max = max, glob_min = min;
     printf("avr = %.1f, std = %.1f, Noverload = %zd\n", avr, std, Noverld);
     printf("max = %u, min = %u, W*H = %zd\n", max, min, size);
@@ -252,6 +390,7 @@ void print_stat(imstorage *img){
     ptr = img->imdata; sum = 0.; sum2 = 0.;
     tres = avr + 3. * std; // max treshold == 3sigma
     for(i = 0; i < size; i++, ptr++){
+        if(img->rowmask && !img->rowmask[i / img->W]) continue;
         val = *ptr;
         pv = (double) val;
         if(pv > tres){
@@ -271,7 +410,7 @@ void print_stat(imstorage *img){
     printf("At 3sigma: Noverload = %zd, avr = %.3f, std = %.3f\n", Noverld, avr, std);
 }
 
-#ifndef DAEMON
+#if !defined DAEMON || defined PRODUCTS
 #ifdef LIBCFITSIO
 #define TRYFITS(f, ...)                     \
 do{ int status = 0;                         \
@@ -359,6 +498,12 @@ int writefits(imstorage *img){
         snprintf(buf, 80, "(%d, %d)", img->subframe->Xstart, img->subframe->Ystart);
         WRITEKEY(TSTRING, "SUBFRAME", buf, "Subframe start coordinates (Xstart, Ystart)");
     }
+    if(img->rowmask){ // partial image
+        int partial = 1;
+        long badrows = (long)img->badrows;
+        WRITEKEY(TLOGICAL, "PARTIAL", &partial, "Some data blocks lost in transfer");
+        WRITEKEY(TLONG, "BADROWS", &badrows, "Amount of rows lost (filled by zeros)");
+    }
     // flip image around OX
     size_t W = img->W, Wb = sizeof(uint16_t)*W, H = img->H, imsz = img->W * H, y;
     uint16_t *image = MALLOC(uint16_t, imsz), *optr = image, *iptr = &img->imdata[W*(H-1)];
@@ -373,12 +518,15 @@ int writefits(imstorage *img){
     return 0;
 }
 #endif // LIBCFITSIO
-#endif // !DAEMON
+#endif // !DAEMON || PRODUCTS
 
 static double max_exptime = 180.;
 void set_max_exptime(double t){
     if(t > 30. && t < 300.) max_exptime = t;
 }
+double get_max_exptime(){
+    return max_exptime;
+}
 
 #ifndef CLIENT
 /**
@@ -412,13 +560,10 @@ time_t get_wd_period(){
  */
 int save_histo(FILE *f, imstorage *img){
     if(!img || !img->imdata) return 1000;
-    size_t histogram[256];
-    size_t l, S = img->W*img->H;
-    uint16_t *ptr = img->imdata;
-    memset(histogram, 0, 256 * sizeof(size_t));
-    for(l = 0; l < S; ++l, ++ptr){
-        ++histogram[((*ptr)>>8)&0xff];
-    }
+    imstat stat, *st = get_stat(img, &stat);
+    size_t l, S = st->N;
+    size_t *histogram = st->histogram;
+    if(!S) return 1001;
     if(f){
         for(l = 0; l < 256; ++l){
             int status = fprintf(f, "%zd\t%zd\n", l, histogram[l]);
@@ -438,26 +583,64 @@ int save_histo(FILE *f, imstorage *img){
     DBG("acc = %zd, S = %zd", acc, S);
     printf("low 5%% (%zd pixels) = %d, median (%zd pixels) = %d, up 5%% (%zd pixels) = %d\n",
         low5, lval, med, mval, up5, tval);
-    double mul = 1., mulmax = 255. / tval;
-    if(tval <= 200){ // no overexposed pixels
-        if(lval < 32){ // narrow histogram with overexposed black level
-            mul = 200. / tval;
-        }else mul = 32. / lval;
-    }else{
-        if(mval > 64){
-            if(mval < 200) mul = 64. / mval;
-            else mul = 0.1;
-        }
-    }
-    if(mul > mulmax) mul = mulmax;
-    double E = img->exptime * mul;
-    if(E < 5e-5) E = 5e-5; // too short exposition
-    else if(E > max_exptime) E = max_exptime; // no need to do expositions larger than max_exptime
+    double E = autoexp_next(img, max_exptime); // no need to do expositions larger than max_exptime
     green("Recommended exposition time: %g seconds\n", E);
+    pthread_mutex_lock(&exp_mutex);
     exp_calculated = E;
+    exp_calctime = img->exposetime + img->exptime / 2.;
+    pthread_mutex_unlock(&exp_mutex);
     return 0;
 }
 
+#if defined LIBRAW && (!defined DAEMON || defined PRODUCTS)
+// black level for debayer by image statistics (calculated by print_stat)
+static int black_level(){
+    int lowval = glob_avr - 3*glob_std;
+    if(glob_min > lowval) lowval = glob_min + glob_std/3;
+    return lowval;
+}
+#endif
+
+#if defined DAEMON && defined PRODUCTS
+/**
+ * Save image in one format (for daemon products cache); image is calibrated
+ * as by store_image(): hot pixels are corrected and dark is subtracted before
+ * debayer. Image data isn't changed (calibrated copy is saved).
+ * @param fmt - FORMAT_FITS, FORMAT_TIFF or FORMAT_JPEG
+ * @return 0 if all OK, -1 if format not supported
+ */
+int store_format(imstorage *img, image_format fmt){
+    if(!img->imdata || !img->W || !img->H) return 1;
+    size_t S = img->W * img->H;
+    uint16_t *orig = img->imdata;
+    img->imdata = MALLOC(uint16_t, S);
+    memcpy(img->imdata, orig, S * sizeof(uint16_t));
+    if(img->imtype != IMTYPE_DARK) hotpix_correct(img);
+    print_stat(img); // statistics for FITS header & debayer
+    int ret = -1;
+    switch(fmt){
+        #ifdef LIBCFITSIO
+        case FORMAT_FITS: ret = writefits(img); break;
+        #endif
+        #ifdef LIBTIFF
+        case FORMAT_TIFF: ret = writetiff(img); break;
+        #endif
+        #ifdef LIBRAW
+        case FORMAT_JPEG:{
+            int lowval = black_level();
+            if(img->imtype != IMTYPE_DARK && !darklib_subtract(img)) lowval = 1+glob_std/3;
+            ret = write_debayer(img, (uint16_t)lowval);
+        }
+        break;
+        #endif
+        default: break;
+    }
+    FREE(img->imdata);
+    img->imdata = orig;
+    return ret;
+}
+#endif // DAEMON && PRODUCTS
+
 #ifndef DAEMON
 int writedump(imstorage *img){
     char *name = make_filename(img, SUFFIX_RAW);
@@ -492,6 +675,15 @@ int writedump(imstorage *img){
     }else{
         green(_("Truncated to 256 levels histogram stored in file `%s`\n"), name);
     }
+    if(img->rowmask){ // partial image: store numbers of bad rows
+        name = make_filename(img, "badrows.txt");
+        if(!name || !(h = fopen(name, "w"))) return 7;
+        for(size_t y = 0; y < img->H; ++y)
+            if(!img->rowmask[y]) fprintf(h, "%zd\n", y);
+        fclose(h);
+        modifytimestamp(name, img);
+        green(_("List of bad rows stored in file `%s`\n"), name);
+    }
     return 0;
 }
 
@@ -507,6 +699,11 @@ int store_image(imstorage *img){
         && !get_imdata(img)
     #endif
        ) || !img->W || !img->H) return 1;
+    if(img->imtype == IMTYPE_DARK) darklib_put(img, 1); // save dark into library & refresh hot pixels map
+    else if(hotpix_correct(img)){
+        DBG("Hot pixels corrected");
+        forget_stat(); // recalculate statistics by corrected image
+    }
     print_stat(img);
     #ifdef LIBTIFF
     if(img->imformat & FORMAT_TIFF){ // save tiff file
@@ -522,49 +719,10 @@ int store_image(imstorage *img){
     }
     #endif
     #ifdef LIBRAW
-    static imstorage *dark = NULL;
-    static double lastdtime = 0.;
     if(img->imtype != IMTYPE_DARK){ // store debayer only if image type isn't dark
-        int lowval = glob_avr - 3*glob_std;
-        if(glob_min > lowval) lowval = glob_min + glob_std/3;
-        if(dark) do{
-            if(dtime() - lastdtime > 3600.){ // not more than 1 hour
-                putlog("Dark too old");
-                FREE(dark->imdata);
-                FREE(dark);
-                break;
-            }
-            if(fabs(dark->exptime/img->exptime - 1.) > 0.05){
-                putlog("Exposures too different, dark: %gs, image: %gs", dark->exptime, img->exptime);
-                break;
-            }
-            if(dark->W != img->W || dark->H != img->H){
-                putlog("Dark and image have different sizes");
-                break;
-            }
-            // all OK, extract dark
-            uint16_t *iptr = img->imdata, *dptr = dark->imdata;
-            size_t s, S = img->W * img->H;
-            for(s = 0; s < S; ++s, ++iptr, ++dptr){
-                uint16_t i = *iptr, d = *dptr;
-                if(i > d) *iptr = i - d;
-                else *iptr = 0;
-            }
-            putlog("Dark extracted");
-            lowval = 1+glob_std/3;
-        }while(0);
+        int lowval = black_level();
+        if(!darklib_subtract(img)) lowval = 1+glob_std/3;
         if(write_debayer(img, (uint16_t)lowval)) status |= 8; // and save colour image
-    }else{ // save last dark
-        lastdtime = dtime();
-        if(!dark)
-            dark = MALLOC(imstorage, 1);
-        else
-            FREE(dark->imdata);
-        memcpy(dark, img, sizeof(imstorage));
-        size_t S = img->W*img->H;
-        dark->imdata = MALLOC(uint16_t, S);
-        memcpy(dark->imdata, img->imdata, sizeof(uint16_t)*S);
-        putlog("Save last dark image");
     }
     #endif
     putlog("Save image, status=%d", status);
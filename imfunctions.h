@@ -40,7 +40,8 @@ typedef enum{
     FORMAT_NONE = 0,
     FORMAT_FITS = 1,
     FORMAT_TIFF = 2,
-    FORMAT_RAW  = 4
+    FORMAT_RAW  = 4,
+    FORMAT_JPEG = 8     // debayered image (daemon products only)
 } image_format;
 
 // exposed image type
@@ -68,12 +69,19 @@ typedef struct{
     imsubframe *subframe;
     size_t W, H;       // image size
     uint16_t *imdata;  // image data itself
+    uint8_t *rowmask;  // validity of rows (1 - good) for partial image or NULL
+    size_t badrows;    // amount of lost rows (filled by zeros)
     time_t exposetime; // time of exposition start
     int timestamp; // add timestamp to filename
     int once; // get only one image
 } imstorage;
 
-extern double exp_calculated;
+// short statistics of image
+typedef struct{
+    uint16_t min, max;
+    double mean, std;
+    size_t noverld;    // amount of overloaded pixels
+} imstats;
 
 // image type suffixes
 #define SUFFIX_FITS         "fits.gz"
@@ -83,10 +91,20 @@ extern double exp_calculated;
 
 
 void set_max_exptime(double t);
+double get_max_exptime();
 char *make_filename(imstorage *img, const char *suff);
+void modifytimestamp(const char *filename, imstorage *img);
 imstorage *chk_storeimg(imstorage *img, char* store, char *format);
 int store_image(imstorage *filename);
+#if defined DAEMON && defined PRODUCTS
+int store_format(imstorage *img, image_format fmt);
+#endif
 void print_stat(imstorage *img);
+void stat_block_consumer(imstorage *img, const uint16_t *data, size_t offset, size_t npix, void *arg);
+void forget_stat();
+void get_imstats(imstorage *img, imstats *s);
+int colour_step(int binning);
+int get_exp_calculated(double *exptime, double *calctime);
 
 #ifndef CLIENT
 uint16_t *get_imdata(imstorage *img);
@@ -27,12 +27,22 @@
 #include <sys/prctl.h>
 #endif
 #ifndef CLIENT
+    #include "autoexp.h"
+    #ifdef DAEMON
+    #include "ephem.h"
+    #endif
     #include "term.h"
 #endif
 #include "cmdlnopts.h"
 #include "imfunctions.h"
 #if defined CLIENT || defined DAEMON
     #include "socket.h"
+#else
+    #include "bench.h"
+#endif
+#if !defined DAEMON || defined PRODUCTS
+    #include "darklib.h"
+    #include "hotpix.h"
 #endif
 
 void signals(int signo){
@@ -59,8 +69,33 @@ int main(int argc, char **argv){
 #endif
     imstorage *img = NULL;
     imsubframe *F = NULL;
+    #if !defined DAEMON || defined PRODUCTS
+    if(darklib_stacking(G->dark_stack, G->dark_combine))
+        ERRX(_("Wrong dark stacking parameters"));
+    if(hotpix_setup(G->hotpix))
+        ERRX(_("Can't load hot pixels map"));
+    #endif
+    #ifdef CLIENT
+    if(set_product(G->product))
+        ERRX(_("Wrong product"));
+    set_frames(G->frame, G->since);
+    if(G->frame > 0) G->once = 1; // single image: don't repeat request by guard
+    set_compress(G->compress, G->delta);
+    #endif
     #ifndef CLIENT
     if(G->htrperiod) set_heater_period(G->htrperiod);
+    if(G->partial) set_partial(1);
+    if(autoexp_setup(G->ae_target, G->ae_pct, G->ae_gain, G->ae_maxstep, G->ae_satmax))
+        ERRX(_("Wrong auto exposure parameters"));
+    #ifdef DAEMON
+    if(ephem_setup(G->latitude, G->longitude))
+        ERRX(_("Wrong site coordinates"));
+    if(set_ring(G->ring))
+        ERRX(_("Wrong ring length"));
+    if(set_keyframes(G->keyframes))
+        ERRX(_("Wrong key images period"));
+    #endif
+    add_block_consumer(stat_block_consumer, NULL); // statistics & histogram while image transferring
     if(G->max_exptime > 0) set_max_exptime(G->max_exptime);
     if(G->splist){
         list_speeds();
@@ -97,9 +132,16 @@ int main(int argc, char **argv){
     }
     char *fw = get_firmvare_version();
     if(fw) printf(_("Firmware version: %s\n"), fw);
-    if(G->newspeed && term_setspeed(G->newspeed)){
-        putlog("Can't change speed to %d", G->newspeed);
-        ERRX(_("Can't change speed to %d"), G->newspeed);
+    if(G->newspeed){
+        if(term_setspeed(G->newspeed)){
+            putlog("Can't change speed to %d", G->newspeed);
+            ERRX(_("Can't change speed to %d"), G->newspeed);
+        }
+    }else if(G->autospeed && !G->speed){ // user gave no speed - find the best
+        if(!term_autospeed()){
+            putlog("Connection lost while speed changing");
+            ERRX(_("Connection lost while speed changing"));
+        }
     }
     if(G->shutter_cmd && shutter_command(G->shutter_cmd)){
         putlog("Can't send shutter command: %s", G->shutter_cmd);
@@ -108,6 +150,9 @@ int main(int argc, char **argv){
     if(G->heater != HEATER_LEAVE){
         heater(G->heater); // turn on/off heater
     }
+#if !defined DAEMON
+    if(G->bench > 0) return run_bench(G);
+#endif
 #ifndef DAEMON
     if(G->takeimg){
 #endif // DAEMON
@@ -0,0 +1,219 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * products.c - images encoded by daemon once for all clients
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Daemon built with image libraries (make DAEMONIMG=1) encodes each product
+ * (FITS, TIFF, JPEG) of current image by first request and keeps it in cache
+ * until next image: all other clients get the same bytes. Products are made
+ * by the same functions as client's files (through temporary directory).
+ */
+
+#include "products.h"
+#include "proto.h"
+#include "usefull_macros.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <strings.h> // strncasecmp
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const struct{
+    const char *name;
+    const char *suffix;
+    const char *mime;
+} products[PRODUCT_AMOUNT] = {
+    [PRODUCT_FITS] = {"fits", SUFFIX_FITS, "image/fits"},
+    [PRODUCT_TIFF] = {"tiff", SUFFIX_TIFF, "image/tiff"},
+    [PRODUCT_JPEG] = {"jpeg", SUFFIX_JPEG, "image/jpeg"},
+};
+
+/**
+ * @return product type by its name or -1
+ */
+int product_bytype(const char *name){
+    if(!name) return -1;
+    int L = strlen(name);
+    if(!L) return -1;
+    for(int i = 0; i < PRODUCT_AMOUNT; ++i)
+        if(0 == strncasecmp(name, products[i].name, L)) return i;
+    return -1;
+}
+
+const char *product_name(product_type t){
+    return products[t].name;
+}
+const char *product_suffix(product_type t){
+    return products[t].suffix;
+}
+const char *product_mime(product_type t){
+    return products[t].mime;
+}
+
+#ifdef DAEMON
+static product *cache[PRODUCT_AMOUNT];
+// cache pointers & references counters
+static pthread_mutex_t prodmutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef PRODUCTS
+// encoding is not thread-safe (make_filename & statistics), so there's one encoder at a time;
+// it's a separate mutex, so releasing products (by server loop) never waits for encoding
+static pthread_mutex_t encmutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * @return 1 if daemon can make product `t`
+ */
+int product_supported(product_type t){
+    switch(t){
+        #ifdef PRODUCTS
+        #ifdef LIBCFITSIO
+        case PRODUCT_FITS: return 1;
+        #endif
+        #ifdef LIBTIFF
+        case PRODUCT_TIFF: return 1;
+        #endif
+        #ifdef LIBRAW
+        case PRODUCT_JPEG: return 1;
+        #endif
+        #endif // PRODUCTS
+        default: return 0;
+    }
+}
+
+#ifdef PRODUCTS
+static char tmpdir[] = "/tmp/sbig340_XXXXXX";
+static int havetmp = 0;
+
+// read whole file `name` into memory and remove it
+static uint8_t *slurp(const char *name, size_t *len){
+    uint8_t *buf = NULL;
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if(fd < 0){
+        WARN(_("Can't open %s"), name);
+        return NULL;
+    }
+    if(!fstat(fd, &st) && st.st_size > 0){
+        buf = MALLOC(uint8_t, st.st_size);
+        size_t got = 0;
+        while(got < (size_t)st.st_size){
+            ssize_t r = read(fd, buf + got, st.st_size - got);
+            if(r <= 0) break;
+            got += r;
+        }
+        if(got != (size_t)st.st_size) FREE(buf);
+        else *len = got;
+    }
+    close(fd);
+    unlink(name);
+    return buf;
+}
+
+// encode image `img` into product `t`
+static product *encode(product_type t, imstorage *img, uint64_t imctr){
+    static const image_format fmts[PRODUCT_AMOUNT] = {
+        [PRODUCT_FITS] = FORMAT_FITS, [PRODUCT_TIFF] = FORMAT_TIFF, [PRODUCT_JPEG] = FORMAT_JPEG};
+    if(!havetmp){
+        if(!mkdtemp(tmpdir)){
+            WARN("mkdtemp()");
+            return NULL;
+        }
+        havetmp = 1;
+    }
+    char base[FILENAME_MAX], name[FILENAME_MAX];
+    snprintf(base, FILENAME_MAX, "%s/product", tmpdir);
+    snprintf(name, FILENAME_MAX, "%s/product.%s", tmpdir, products[t].suffix);
+    imstorage tmp = *img;
+    tmp.imname = base;
+    tmp.st = STORE_REWRITE;
+    tmp.timestamp = 0;
+    double t0 = dtime();
+    if(store_format(&tmp, fmts[t])){
+        unlink(name);
+        return NULL;
+    }
+    size_t len = 0;
+    uint8_t *data = slurp(name, &len);
+    if(!data) return NULL;
+    product *p = MALLOC(product, 1);
+    p->imctr = imctr;
+    p->data = data;
+    p->len = len;
+    p->crc = proto_crc(data, len, 0);
+    putlog("Product %s of image %llu: %zd bytes in %.3fs", products[t].name,
+           (unsigned long long)imctr, len, dtime() - t0);
+    return p;
+}
+#endif // PRODUCTS
+
+// decrement references counter (call with locked prodmutex)
+static void unref(product *p){
+    if(--p->refs) return;
+    FREE(p->data);
+    FREE(p);
+}
+
+// get reference to cached product `t` of image `imctr` or NULL
+static product *cached(product_type t, uint64_t imctr){
+    product *p = NULL;
+    pthread_mutex_lock(&prodmutex);
+    if(cache[t] && cache[t]->imctr == imctr){
+        p = cache[t];
+        ++p->refs;
+    }
+    pthread_mutex_unlock(&prodmutex);
+    return p;
+}
+
+/**
+ * Get product `t` of image `img` number `imctr` (encode it if cache is outdated)
+ * `img` shouldn't be changed during this call
+ * @return product (release it by product_release() after using) or NULL
+ */
+product *product_get(product_type t, imstorage *img, uint64_t imctr){
+    if(!product_supported(t) || !img || !img->imdata) return NULL;
+    product *p = cached(t, imctr);
+    #ifdef PRODUCTS
+    if(p) return p;
+    pthread_mutex_lock(&encmutex);
+    p = cached(t, imctr); // could be encoded while we waited
+    if(!p && (p = encode(t, img, imctr))){
+        p->refs = 2; // references of cache & caller
+        pthread_mutex_lock(&prodmutex);
+        if(cache[t]) unref(cache[t]);
+        cache[t] = p;
+        pthread_mutex_unlock(&prodmutex);
+    }
+    pthread_mutex_unlock(&encmutex);
+    #endif
+    return p;
+}
+
+/**
+ * Release product got by product_get()
+ */
+void product_release(product *p){
+    if(!p) return;
+    pthread_mutex_lock(&prodmutex);
+    unref(p);
+    pthread_mutex_unlock(&prodmutex);
+}
+#endif // DAEMON
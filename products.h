@@ -0,0 +1,54 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * products.h - images encoded by daemon once for all clients
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __PRODUCTS_H__
+#define __PRODUCTS_H__
+
+#include "imfunctions.h"
+
+typedef enum{
+    PRODUCT_FITS,
+    PRODUCT_TIFF,
+    PRODUCT_JPEG,
+    PRODUCT_AMOUNT
+} product_type;
+
+// encoded image
+typedef struct{
+    uint64_t imctr;     // number of image it made from
+    uint8_t *data;      // file content
+    size_t len;
+    uint32_t crc;       // CRC32 of data
+    int refs;           // references counter
+} product;
+
+int product_bytype(const char *name);
+const char *product_name(product_type t);
+const char *product_suffix(product_type t);
+const char *product_mime(product_type t);
+
+#ifdef DAEMON
+int product_supported(product_type t);
+product *product_get(product_type t, imstorage *img, uint64_t imctr);
+void product_release(product *p);
+#endif
+
+#endif // __PRODUCTS_H__
@@ -0,0 +1,125 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * proto.c - binary protocol (v2) between daemon and client
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#if defined CLIENT || defined DAEMON
+
+/*
+ * Daemon sends frames in binary format when client asks for it by "proto=2";
+ * client which gets text answer (old daemon) falls back to text format.
+ * Client knows whole frame length by fixed-size header and reads exactly it.
+ */
+
+#include "proto.h"
+#include "usefull_macros.h"
+
+#include <endian.h>
+#include <pthread.h>
+
+static uint32_t crctab[256];
+static pthread_once_t crconce = PTHREAD_ONCE_INIT;
+
+static void mkcrctab(){
+    for(uint32_t i = 0; i < 256; ++i){
+        uint32_t c = i;
+        for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crctab[i] = c;
+    }
+}
+
+/**
+ * CRC32 (the same as zlib's crc32()) of `data`
+ * @param crc - CRC of previous data (0 for first portion)
+ */
+uint32_t proto_crc(const void *data, size_t len, uint32_t crc){
+    pthread_once(&crconce, mkcrctab);
+    const uint8_t *d = data;
+    crc = ~crc;
+    while(len--) crc = crctab[(crc ^ *d++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// @return payload length of raw image
+size_t proto_rawlen(const imstorage *im){
+    return im->W * im->H * sizeof(uint16_t) + (im->rowmask ? im->H : 0);
+}
+
+// @return CRC32 of raw image payload
+uint32_t proto_rawcrc(const imstorage *im){
+    uint32_t crc = proto_crc(im->imdata, im->W * im->H * sizeof(uint16_t), 0);
+    if(im->rowmask) crc = proto_crc(im->rowmask, im->H, crc);
+    return crc;
+}
+
+/**
+ * Fill header of frame
+ * @param im      - image
+ * @param id      - its number
+ * @param payload - PROTO_RAW or PROTO_PRODUCT + product type
+ * @param paylen, crc - payload length & CRC32
+ */
+void proto_mkhdr(proto_hdr *h, const imstorage *im, uint64_t id, int payload, size_t paylen, uint32_t crc){
+    memset(h, 0, sizeof(proto_hdr));
+    h->magic = htole32(PROTO_MAGIC);
+    h->version = htole16(PROTO_VERSION);
+    h->hdrlen = htole16(sizeof(proto_hdr));
+    h->paylen = htole32(paylen);
+    h->crc = htole32(crc);
+    h->frameid = htole64(id);
+    h->exposetime = htole64(im->exposetime);
+    h->exptime = htole64((uint64_t)(im->exptime * 1e6 + 0.5));
+    h->W = htole16(im->W);
+    h->H = htole16(im->H);
+    if(im->subframe){
+        h->subX = htole16(im->subframe->Xstart);
+        h->subY = htole16(im->subframe->Ystart);
+        h->subS = htole16(im->subframe->size);
+    }
+    h->badrows = htole16(im->rowmask ? im->badrows : 0);
+    h->binning = im->binning;
+    h->imtype = im->imtype;
+    h->payload = payload;
+}
+
+/**
+ * Check & convert header from `buf` of length `len`
+ * @return 0 if header is valid
+ */
+int proto_gethdr(const uint8_t *buf, size_t len, proto_hdr *h){
+    if(len < sizeof(proto_hdr)) return 1;
+    memcpy(h, buf, sizeof(proto_hdr));
+    h->magic = le32toh(h->magic);
+    h->version = le16toh(h->version);
+    h->hdrlen = le16toh(h->hdrlen);
+    if(h->magic != PROTO_MAGIC || h->version < PROTO_VERSION || h->hdrlen < sizeof(proto_hdr)) return 1;
+    h->paylen = le32toh(h->paylen);
+    h->crc = le32toh(h->crc);
+    h->frameid = le64toh(h->frameid);
+    h->exposetime = le64toh(h->exposetime);
+    h->exptime = le64toh(h->exptime);
+    h->W = le16toh(h->W);
+    h->H = le16toh(h->H);
+    h->subX = le16toh(h->subX);
+    h->subY = le16toh(h->subY);
+    h->subS = le16toh(h->subS);
+    h->badrows = le16toh(h->badrows);
+    return 0;
+}
+
+#endif // CLIENT || DAEMON
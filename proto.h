@@ -0,0 +1,72 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * proto.h - binary protocol (v2) between daemon and client
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include "imfunctions.h"
+
+// "SB34" in stream
+#define PROTO_MAGIC     (0x34334253)
+#define PROTO_VERSION   (2)
+// payload types
+#define PROTO_RAW       (0)
+// products are sent as PROTO_PRODUCT + product_type
+#define PROTO_PRODUCT   (1)
+// codecs of raw image pixels
+#define PROTO_PLAIN     (0)
+#define PROTO_RICE      (1)
+#define PROTO_DELTA     (2)
+
+/*
+ * Binary frame: header, then `paylen` bytes of payload. Payload of raw image
+ * is W*H pixels (uint16_t) and `H` bytes of rows mask (1 - good row) if
+ * image is partial (pixels could be compressed by codec given in header);
+ * payload of product is encoded file. All fields are little-endian.
+ * Payload of PROTO_DELTA image starts with number of reference image
+ * (uint64_t): pixels are compressed by rice_encode_delta() with it.
+ */
+typedef struct __attribute__((packed)){
+    uint32_t magic;         // PROTO_MAGIC
+    uint16_t version;       // PROTO_VERSION
+    uint16_t hdrlen;        // length of header (could grow in next versions)
+    uint32_t paylen;        // length of payload
+    uint32_t crc;           // CRC32 of payload
+    uint64_t frameid;       // image number
+    int64_t exposetime;     // time of exposition start (UNIX time)
+    uint64_t exptime;       // exposition time (microseconds)
+    uint16_t W, H;          // image size
+    uint16_t subX, subY;    // subframe (if binning == 0xff)
+    uint16_t subS;
+    uint16_t badrows;       // amount of lost rows (rows mask is in payload)
+    uint8_t binning;
+    uint8_t imtype;
+    uint8_t payload;        // PROTO_RAW or PROTO_PRODUCT + product type
+    uint8_t codec;          // PROTO_PLAIN, PROTO_RICE or PROTO_DELTA (pixels of raw image)
+} proto_hdr;
+
+uint32_t proto_crc(const void *data, size_t len, uint32_t crc);
+size_t proto_rawlen(const imstorage *im);
+uint32_t proto_rawcrc(const imstorage *im);
+void proto_mkhdr(proto_hdr *h, const imstorage *im, uint64_t id, int payload, size_t paylen, uint32_t crc);
+int proto_gethdr(const uint8_t *buf, size_t len, proto_hdr *h);
+
+#endif // __PROTO_H__
@@ -0,0 +1,252 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * rice.c - lossless compression of images (prediction & Rice coding)
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#if defined CLIENT || defined DAEMON
+
+/*
+ * Each pixel is predicted by its neighbours of the same colour (`step`
+ * pixels left, up and up-left: MED predictor of LOCO-I), residual (modulo
+ * 2^16) is mapped to unsigned (0, -1, 1, -2, ...) and coded by Rice code
+ * with parameter k chosen for each RICE_BLOCK residuals: 4 bits of k, then
+ * for each residual quotient (v >> k) in unary code (ones terminated by zero)
+ * and k low bits. Quotient >= RICE_MAXQ is written as RICE_MAXQ ones and 16
+ * bits of value. Bits are packed MSB first.
+ * Delta compression (for stream of images) predicts block by previous image
+ * if it's better: static parts of image (horizon, hot pixels) are coded
+ * by their noise only.
+ */
+
+#include "rice.h"
+
+typedef struct{
+    uint8_t *out;
+    size_t pos;
+    uint64_t acc;
+    int n;          // bits in acc
+} bitwriter;
+
+typedef struct{
+    const uint8_t *in;
+    size_t len, pos;
+    uint64_t acc;
+    int n;
+} bitreader;
+
+// put `n` (<= 32) low bits of `val`
+static inline void putbits(bitwriter *w, uint32_t val, int n){
+    if(!n) return;
+    w->acc = (w->acc << n) | (val & (uint32_t)((1ULL << n) - 1));
+    w->n += n;
+    while(w->n >= 8){
+        w->n -= 8;
+        w->out[w->pos++] = (uint8_t)(w->acc >> w->n);
+    }
+}
+
+static inline void fillbits(bitreader *r){
+    while(r->n <= 56){
+        r->acc = (r->acc << 8) | (r->pos < r->len ? r->in[r->pos] : 0);
+        ++r->pos;
+        r->n += 8;
+    }
+}
+
+// get `n` (<= 32) bits
+static inline uint32_t getbits(bitreader *r, int n){
+    if(!n) return 0;
+    fillbits(r);
+    r->n -= n;
+    return (uint32_t)(r->acc >> r->n) & (uint32_t)((1ULL << n) - 1);
+}
+
+// prediction of pixel (x, y) by already known pixels
+static inline uint16_t predict(const uint16_t *p, size_t x, size_t y, size_t W, int step){
+    if(y < (size_t)step){
+        if(x < (size_t)step) return 0;
+        return p[-step];
+    }
+    if(x < (size_t)step) return p[-step*W];
+    int a = p[-step], b = p[-step*W], c = p[-step*W - step];
+    int mx = a > b ? a : b, mn = a > b ? b : a;
+    if(c >= mx) return mn;
+    if(c <= mn) return mx;
+    return a + b - c;
+}
+
+// @return max length of compressed image with `npix` pixels
+size_t rice_bound(size_t npix){
+    return npix * 5 + npix / RICE_BLOCK + 16;
+}
+
+// map residual to unsigned: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+static inline uint16_t zigzag(int16_t r){
+    return (uint16_t)((r << 1) ^ (r >> 15));
+}
+
+// the best Rice parameter for `n` residuals with sum `sum`
+static inline int rice_k(int n, uint32_t sum){
+    int k = 0;
+    while(k < 15 && ((uint32_t)n << (k + 1)) <= sum) ++k;
+    return k;
+}
+
+// put `n` residuals coded with parameter `k`
+static inline void putblock(bitwriter *w, const uint16_t *zz, int n, int k){
+    for(int j = 0; j < n; ++j){
+        uint32_t q = zz[j] >> k;
+        if(q < RICE_MAXQ){
+            putbits(w, (1U << (q + 1)) - 2, q + 1);
+            putbits(w, zz[j], k);
+        }else{ // escape
+            putbits(w, (1U << RICE_MAXQ) - 1, RICE_MAXQ);
+            putbits(w, zz[j], 16);
+        }
+    }
+}
+
+// get next residual coded with parameter `k`
+static inline int16_t getres(bitreader *r, int k){
+    fillbits(r);
+    uint64_t top = ~(r->acc << (64 - r->n)); // zeros in place of leading ones
+    int q = __builtin_clzll(top);
+    uint32_t v;
+    if(q >= RICE_MAXQ){
+        r->n -= RICE_MAXQ;
+        v = getbits(r, 16);
+    }else{
+        r->n -= q + 1;
+        v = ((uint32_t)q << k) | getbits(r, k);
+    }
+    return (int16_t)((v >> 1) ^ (~(v & 1) + 1));
+}
+
+// check that all data (except padding) is read
+static inline int readall(bitreader *r){
+    return (r->pos - r->n / 8 > r->len);
+}
+
+/**
+ * Compress image
+ * @param out - buffer of rice_bound(W*H) bytes at least
+ * @return length of compressed data
+ */
+size_t rice_encode(const uint16_t *data, size_t W, size_t H, int step, uint8_t *out){
+    bitwriter w = {.out = out};
+    size_t npix = W * H, i = 0, x = 0, y = 0;
+    uint16_t zz[RICE_BLOCK];
+    while(i < npix){
+        int n = 0;
+        uint32_t sum = 0;
+        for(; n < RICE_BLOCK && i < npix; ++n, ++i){
+            zz[n] = zigzag((int16_t)(data[i] - predict(data + i, x, y, W, step)));
+            sum += zz[n];
+            if(++x == W){
+                x = 0;
+                ++y;
+            }
+        }
+        int k = rice_k(n, sum);
+        putbits(&w, k, 4);
+        putblock(&w, zz, n, k);
+    }
+    if(w.n) putbits(&w, 0, 8 - w.n);
+    return w.pos;
+}
+
+/**
+ * Decompress image of size WxH from `in` of length `len` into `out`
+ * @return 0 if all OK
+ */
+int rice_decode(const uint8_t *in, size_t len, size_t W, size_t H, int step, uint16_t *out){
+    bitreader r = {.in = in, .len = len};
+    size_t npix = W * H, i = 0, x = 0, y = 0;
+    while(i < npix){
+        int k = getbits(&r, 4);
+        for(int n = 0; n < RICE_BLOCK && i < npix; ++n, ++i){
+            int16_t d = getres(&r, k);
+            out[i] = (uint16_t)(predict(out + i, x, y, W, step) + d);
+            if(++x == W){
+                x = 0;
+                ++y;
+            }
+        }
+        if(r.pos > len + 8) return 1; // data is over
+    }
+    return readall(&r);
+}
+
+/**
+ * Compress image by previous image `ref` of the same geometry: each block of
+ * RICE_BLOCK pixels is predicted by the same pixels of `ref` or by
+ * neighbours (as rice_encode() does), which one gives less residuals; block
+ * starts with 4 bits of k and 1 bit of predictor (1 - by `ref`)
+ * @param out - buffer of rice_bound(W*H) bytes at least
+ * @return length of compressed data
+ */
+size_t rice_encode_delta(const uint16_t *data, const uint16_t *ref, size_t W, size_t H, int step, uint8_t *out){
+    bitwriter w = {.out = out};
+    size_t npix = W * H, i = 0, x = 0, y = 0;
+    uint16_t zs[RICE_BLOCK], zt[RICE_BLOCK];
+    while(i < npix){
+        int n = 0;
+        uint32_t ss = 0, st = 0;
+        for(; n < RICE_BLOCK && i < npix; ++n, ++i){
+            zs[n] = zigzag((int16_t)(data[i] - predict(data + i, x, y, W, step)));
+            zt[n] = zigzag((int16_t)(data[i] - ref[i]));
+            ss += zs[n];
+            st += zt[n];
+            if(++x == W){
+                x = 0;
+                ++y;
+            }
+        }
+        int t = (st < ss), k = rice_k(n, t ? st : ss);
+        putbits(&w, (k << 1) | t, 5);
+        putblock(&w, t ? zt : zs, n, k);
+    }
+    if(w.n) putbits(&w, 0, 8 - w.n);
+    return w.pos;
+}
+
+/**
+ * Decompress image of size WxH compressed by rice_encode_delta() with
+ * previous image `ref`
+ * @return 0 if all OK
+ */
+int rice_decode_delta(const uint8_t *in, size_t len, const uint16_t *ref, size_t W, size_t H, int step, uint16_t *out){
+    bitreader r = {.in = in, .len = len};
+    size_t npix = W * H, i = 0, x = 0, y = 0;
+    while(i < npix){
+        int kt = getbits(&r, 5), k = kt >> 1;
+        for(int n = 0; n < RICE_BLOCK && i < npix; ++n, ++i){
+            int16_t d = getres(&r, k);
+            uint16_t p = (kt & 1) ? ref[i] : predict(out + i, x, y, W, step);
+            out[i] = (uint16_t)(p + d);
+            if(++x == W){
+                x = 0;
+                ++y;
+            }
+        }
+        if(r.pos > len + 8) return 1; // data is over
+    }
+    return readall(&r);
+}
+
+#endif // CLIENT || DAEMON
@@ -0,0 +1,39 @@
+/*                                                                                                  geany_encoding=koi8-r
+ * rice.h - lossless compression of images (prediction & Rice coding)
+ *
+ * Copyright 2017 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#pragma once
+#ifndef __RICE_H__
+#define __RICE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// amount of residuals with common Rice parameter
+#define RICE_BLOCK      (32)
+// quotient since which value is written as is
+#define RICE_MAXQ       (24)
+
+size_t rice_bound(size_t npix);
+size_t rice_encode(const uint16_t *data, size_t W, size_t H, int step, uint8_t *out);
+int rice_decode(const uint8_t *in, size_t len, size_t W, size_t H, int step, uint16_t *out);
+size_t rice_encode_delta(const uint16_t *data, const uint16_t *ref, size_t W, size_t H, int step, uint8_t *out);
+int rice_decode_delta(const uint8_t *in, size_t len, const uint16_t *ref, size_t W, size_t H, int step, uint16_t *out);
+
+#endif // __RICE_H__
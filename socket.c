@@ -22,25 +22,53 @@
  */
 #if defined CLIENT || defined DAEMON
 
+#include "autoexp.h"
+#include "darklib.h"
+#include "ephem.h"
+#include "events.h"
+#include "http.h"
+#include "products.h"
+#include "proto.h"
+#include "rice.h"
 #include "socket.h"
 #include "term.h"
 #include "usefull_macros.h"
 
 #include <arpa/inet.h>  // inet_ntop
+#include <ctype.h>      // isalpha
+#include <endian.h>     // le32toh
 #include <limits.h>     // INT_xxx
+#include <linux/sockios.h> // SIOCOUTQ
 #include <netdb.h>      // addrinfo
 #include <pthread.h>
 #include <signal.h>     // pthread_kill
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>  //prctl
+#include <sys/uio.h>    // iovec
 #include <sys/wait.h>   // wait
 #include <unistd.h>     // daemon
 
 #define BUFLEN    (10240)
 #define BUFLEN10  (1048576)
+// client: max pause (seconds) while reading image data
+#define READ_TMOUT (10)
+// log duty cycle once per this amount of frames
+#define DUTY_LOG_PERIOD (10)
 // Max amount of connections
 #define BACKLOG   (30)
+// amount of threads sending images to clients
+#define SENDERS   (4)
+// max events got by one epoll_wait()
+#define MAXEVENTS (64)
+// new client without request starts to get images after this time (seconds)
+#define CLIENT_WAIT     (1.)
+// client which can't receive data during this time (seconds) is disconnected
+#define CLIENT_SNDTMOUT (30)
 
 /**************** COMMON FUNCTIONS ****************/
+#ifdef CLIENT
 /**
  * wait for answer from socket
  * @param sock - socket fd
@@ -72,6 +100,7 @@ static int waittoread(int sock){
     if(FD_ISSET(sock, &fds))  return  1;
     return 0;
 }
+#endif // CLIENT
 
 static uint8_t *findpar(uint8_t *str, char *par){
     size_t L = strlen(par);
@@ -112,107 +141,605 @@ static int getdpar(uint8_t *str, char *parameter, double *ret){
 
 /**************** CLIENT/SERVER FUNCTIONS ****************/
 #ifdef DAEMON
-static double min_dark_exp, dark_interval;
-static imstorage *storedima = NULL;
-static uint64_t imctr = 0; // image counter
+static double min_dark_exp;
+/*
+ * Published images are immutable: they are never changed after publishing
+ * and are freed (or reused) only when last reference is released, so senders
+ * don't hold any lock while writing into socket
+ */
+typedef struct{
+    imstorage im;       // image itself
+    uint64_t id;        // its number (imctr)
+    int refs;           // references counter (ring & senders), atomic
+    uint32_t crc;       // CRC32 of binary protocol payload
+    // compressed payload (made by first request)
+    uint8_t *rice;      // compressed pixels & rows mask
+    size_t ricelen;     // its length (0 if not compressed yet)
+    size_t ricesize;    // size of buffer
+    uint32_t ricecrc;
+    // compressed by previous image (for delta codec)
+    uint8_t *delta;     // number of previous image, compressed pixels & rows mask
+    size_t deltalen;    // its length (0 if not compressed yet)
+    size_t deltasize;
+    uint32_t deltacrc;
+    pthread_mutex_t ricemutex; // protects both compressed payloads
+} frame;
+// ring of last images: image number `id` lives in ring[id % ringlen]
+static frame *ring[RING_MAX];
+static int ringlen = RING_LEN;
+static int keyframes = KEYFRAMES; // delta codec: each keyframes'th image is sent as is
+static uint64_t imctr = 0; // image counter (number of newest image in ring)
+static int framefd = -1; // eventfd: new image published
+// image went out of use: its memory will be used by next image
+static frame *spare = NULL;
+static pthread_mutex_t sparemutex = PTHREAD_MUTEX_INITIALIZER;
+static double duty = -1.; // sensor duty cycle: part of time when it exposes (<0 if unknown)
+// protects ring & imctr only (it's never held during I/O)
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 // setter for min_dark_exp, dark_interval
 void set_darks(double exp, double dt){
     min_dark_exp = exp;
-    dark_interval = dt;
+    darklib_setup(dt); // darks older than dark_interval are stale
 }
-static void clearimstorage(){
-    if(!storedima) return;
-    FREE(storedima->imname);
-    FREE(storedima->subframe);
-    FREE(storedima->imdata);
-    FREE(storedima);
+/**
+ * Set amount of last images kept in memory
+ * @return 0 if all OK
+ */
+int set_ring(int n){
+    if(n < 1 || n > RING_MAX){
+        WARNX(_("Ring length should be from 1 to %d"), RING_MAX);
+        return 1;
+    }
+    ringlen = n;
+    return 0;
 }
-static imstorage *copyima(imstorage *im){
-    FNAME();
-    clearimstorage();
-    if(!im || !im->imdata) return NULL;
-    storedima = MALLOC(imstorage, 1);
-    #define CLR() do{clearimstorage(); return NULL;}while(0)
-    if(!memcpy(storedima, im, sizeof(imstorage))) CLR();
-    if(im->imname){
-        if(!(storedima->imname = strdup(im->imname))) CLR();
+/**
+ * Set period of key images for clients getting delta compressed images
+ * @return 0 if all OK
+ */
+int set_keyframes(int n){
+    if(n < 1){
+        WARNX(_("Key images period should be positive"));
+        return 1;
     }
-    if(im->subframe){
-        storedima->subframe = MALLOC(imsubframe, 1);
-        if(!memcpy(storedima->subframe, im->subframe, sizeof(imsubframe))) CLR();
+    keyframes = n;
+    return 0;
+}
+
+static void freeframe(frame *f){
+    if(!f) return;
+    FREE(f->im.imname);
+    FREE(f->im.subframe);
+    FREE(f->im.imdata);
+    FREE(f->im.rowmask);
+    FREE(f->rice);
+    FREE(f->delta);
+    pthread_mutex_destroy(&f->ricemutex);
+    FREE(f);
+}
+
+// @return number of oldest image in ring (call with locked mutex)
+static uint64_t ring_oldest(){
+    return (imctr > (uint64_t)ringlen) ? imctr - ringlen + 1 : 1;
+}
+
+// keep image out of use to reuse its memory (only one is kept)
+static void recycle(frame *f){
+    if(!f) return;
+    pthread_mutex_lock(&sparemutex);
+    frame *old = spare;
+    spare = f;
+    pthread_mutex_unlock(&sparemutex);
+    freeframe(old);
+}
+
+static void evnotify(int fd){
+    uint64_t one = 1;
+    if(fd > -1 && sizeof(one) != write(fd, &one, sizeof(one))) WARN("write(eventfd)");
+}
+static void evclear(int fd){
+    uint64_t val;
+    if(sizeof(val) != read(fd, &val, sizeof(val))) DBG("eventfd is empty");
+}
+
+/**
+ * Get reference to image number `id`
+ * @return image (release it by frame_put() after using) or NULL if it isn't in ring
+ */
+static frame *frame_get(uint64_t id){
+    frame *f = NULL;
+    pthread_mutex_lock(&mutex);
+    if(id && id <= imctr && id >= ring_oldest()){
+        f = ring[id % ringlen];
+        __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
     }
-    if(im->imdata){
-        size_t S = im->W*im->H*sizeof(uint16_t);
-        if(!(storedima->imdata = malloc(S))) CLR();
-        if(!memcpy(storedima->imdata, im->imdata, S)) CLR();
+    pthread_mutex_unlock(&mutex);
+    return f;
+}
+
+// release reference to image
+static void frame_put(frame *f){
+    if(!f) return;
+    if(__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL)) return;
+    recycle(f);
+}
+
+/**
+ * Get numbers of newest & oldest images in ring
+ * @return newest image number (0 if there's no images yet)
+ */
+static uint64_t ring_range(uint64_t *oldest){
+    pthread_mutex_lock(&mutex);
+    uint64_t last = imctr;
+    if(oldest) *oldest = imctr ? ring_oldest() : 0;
+    pthread_mutex_unlock(&mutex);
+    return last;
+}
+
+/**
+ * Move image data from `im` (which will be used for next exposition) to new
+ * storage; storage & data buffer of image went out of use are reused, so
+ * there's no allocations when ring is full
+ * @return new storage
+ */
+static frame *takeima(imstorage *im){
+    pthread_mutex_lock(&sparemutex);
+    frame *f = spare;
+    spare = NULL;
+    pthread_mutex_unlock(&sparemutex);
+    imsubframe *sub = NULL;
+    if(f){ // data buffer will be used by next transfer
+        cam_recycle(f->im.imdata, f->im.W * f->im.H + 1);
+        FREE(f->im.imname);
+        FREE(f->im.rowmask);
+        sub = f->im.subframe;
     }else{
-        WARNX("Where is imdata?");
-        CLR();
+        f = MALLOC(frame, 1);
+        pthread_mutex_init(&f->ricemutex, NULL);
     }
-    #undef CLR
-    DBG("ALL ok");
-    return storedima;
+    memcpy(&f->im, im, sizeof(imstorage));
+    f->im.imname = NULL;
+    if(im->subframe){
+        if(!sub) sub = MALLOC(imsubframe, 1);
+        memcpy(sub, im->subframe, sizeof(imsubframe));
+    }else FREE(sub);
+    f->im.subframe = sub;
+    f->id = 0;
+    f->refs = 0;
+    f->ricelen = 0;
+    f->deltalen = 0;
+    im->imdata = NULL;
+    im->rowmask = NULL;
+    im->badrows = 0;
+    return f;
 }
 
-static int addwebhdr(char *buf, size_t buflen, char *conttype, size_t contlen){
-    return snprintf(buf, buflen,
-        "HTTP/2.0 200 OK\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "Access-Control-Allow-Methods: GET, POST\r\n"
-        "Access-Control-Allow-Credentials: true\r\n"
-        "Content-type: %s\r\nContent-Length: %zd\r\n\r\n", conttype, contlen);
+/*
+ * Post-processing pipeline: acquisition thread gives received image to the
+ * worker through bounded queue and starts next exposition at once; worker
+ * calculates histogram & next exposition time and publishes image
+ */
+#define PIPE_QLEN   (2)
+static struct{
+    frame *frames[PIPE_QLEN];
+    int head, len;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} pipeq = {.head = 0, .len = 0, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Put image into pipeline queue; never blocks: if worker is too slow, the
+ * oldest image is dropped
+ */
+static void pipe_push(frame *f){
+    frame *drop = NULL;
+    pthread_mutex_lock(&pipeq.mutex);
+    if(pipeq.len == PIPE_QLEN){
+        drop = pipeq.frames[pipeq.head];
+        pipeq.head = (pipeq.head + 1) % PIPE_QLEN;
+        --pipeq.len;
+    }
+    pipeq.frames[(pipeq.head + pipeq.len) % PIPE_QLEN] = f;
+    ++pipeq.len;
+    pthread_cond_signal(&pipeq.cond);
+    pthread_mutex_unlock(&pipeq.mutex);
+    if(drop){
+        putlog("Post-processing is too slow, drop image");
+        event_post(EVENT_ERROR, "\"message\":\"Post-processing is too slow, image dropped\"");
+        recycle(drop);
+    }
+}
+
+static const char *imtypes[] = {[IMTYPE_AUTODARK] = "autodark", [IMTYPE_LIGHT] = "light", [IMTYPE_DARK] = "dark"};
+
+// event of image publishing (image is immutable already)
+static void post_frame(frame *f){
+    imstorage *im = &f->im;
+    imstats st;
+    get_imstats(im, &st);
+    event_post(EVENT_FRAME, "\"id\":%llu,\"exptime\":%g,\"imtype\":\"%s\",\"exposetime\":%ld,"
+               "\"W\":%zd,\"H\":%zd,\"binning\":%d,\"badrows\":%zd,\"min\":%u,\"max\":%u,"
+               "\"mean\":%.1f,\"std\":%.1f,\"overloaded\":%zd",
+               (unsigned long long)f->id, im->exptime, imtypes[im->imtype], (long)im->exposetime,
+               im->W, im->H, im->binning, im->badrows, st.min, st.max, st.mean, st.std, st.noverld);
 }
 
-int send_ima(int sock, int webquery){
-    uint8_t buf[BUFLEN10], *bptr = buf, obuff[BUFLEN];
-    int Len, rest = BUFLEN10, imS = storedima->W * storedima->H * sizeof(uint16_t);
-    #define PUT(key, val) do{Len = snprintf((char*)bptr, rest, "%s=%i\n", key, (int)storedima->val); \
+static void *pipe_worker(void _U_ *arg){
+    while(1){
+        pthread_mutex_lock(&pipeq.mutex);
+        while(!pipeq.len) pthread_cond_wait(&pipeq.cond, &pipeq.mutex);
+        frame *f = pipeq.frames[pipeq.head];
+        pipeq.head = (pipeq.head + 1) % PIPE_QLEN;
+        --pipeq.len;
+        pthread_mutex_unlock(&pipeq.mutex);
+        if(f->im.imtype != IMTYPE_DARK)
+            save_histo(NULL, &f->im); // calculate next optimal exposition
+        else{ // remember time of dark for its exposition bucket
+            #ifdef PRODUCTS
+            darklib_put(&f->im, 1); // and its data to calibrate products
+            #else
+            darklib_put(&f->im, 0);
+            #endif
+        }
+        f->crc = proto_rawcrc(&f->im);
+        // publish: no copying, just put pointer into ring; image is immutable since now
+        f->refs = 1; // reference of ring
+        pthread_mutex_lock(&mutex);
+        f->id = ++imctr;
+        frame *old = ring[imctr % ringlen];
+        ring[imctr % ringlen] = f;
+        pthread_mutex_unlock(&mutex);
+        frame_put(old); // will be reused when last sender releases it
+        evnotify(framefd); // wake up clients
+        post_frame(f);
+    }
+    return NULL;
+}
+
+/*
+ * Socket server: one thread with epoll loop accepts connections, reads
+ * requests and wakes up clients waiting for images as soon as new image is
+ * published (through eventfd). Answers are prepared (compressed, encoded) by
+ * small pool of sender threads: client is given to sender (and removed from
+ * epoll) till its answer is ready. Client sockets are non-blocking: answer is
+ * kept in client's output queue (headers and references to image data) and
+ * what socket buffer can't take at once is sent by epoll loop when socket
+ * becomes writable, so slow client never delays others.
+ * Web clients could send next requests by the same connection (HTTP/1.1
+ * keep-alive), so each their request is parsed from beginning.
+ */
+
+// answer which isn't sent yet
+typedef struct{
+    struct iovec iov[4];    // parts of answer
+    int cur, n;             // first part not sent yet & amount of parts
+    frame *f;               // image answer refers to (kept till sent)
+    product *p;             // product answer refers to
+    uint64_t sent, acked;   // bytes sent to socket & got by client (for all answers)
+    double tlast;           // time of last receiving progress of client
+    char web[BUFLEN];       // web header
+    char hdr[BUFLEN];       // text header of image, text answer or events
+    proto_hdr bin;          // binary header of image
+} outqueue;
+
+typedef struct client{
+    int fd;
+    int webquery;           // whether query is web or regular (disconnect after first image)
+    httpreq http;           // current web query
+    int route;              // web query by route (not by parameters)
+    int events;             // client gets events stream
+    uint64_t evid;          // number of last event sent
+    int nreq;               // amount of requests got
+    int prodtype;           // product requested by client or -1 for raw image
+    int since;              // client asked for all images after locctr
+    int streaming;          // client waits for images
+    int oneshot;            // client wants only image `frameid`
+    int proto;              // binary protocol version or 0 for text
+    int codec;              // codec of raw images for binary protocol
+    int busy;               // client is in hands of sender
+    int close;              // disconnect client after answer sending
+    uint32_t evmask;        // epoll events client is watched for (0 - isn't watched)
+    int keyctr;             // images sent by delta codec since last key image
+    uint64_t locctr;        // number of last image sent
+    uint64_t refid;         // number of last image client got (reference for delta codec)
+    uint64_t frameid;       // image requested by "frame="
+    double tconn;           // time of connection
+    double tlast;           // time of last request (for keep-alive timeout)
+    char rbuf[BUFLEN];      // data got from client & not processed yet
+    size_t rlen;
+    outqueue out;           // answer sending
+    struct client *next;    // next in queue
+} client;
+
+// release image & product answer refers to and forget it
+static void out_clear(client *c){
+    outqueue *o = &c->out;
+    frame_put(o->f);
+    o->f = NULL;
+    if(o->p) product_release(o->p);
+    o->p = NULL;
+    o->cur = o->n = 0;
+}
+
+/**
+ * Send the rest of client's answer (as much as socket buffer can take):
+ * closed socket gives error instead of SIGPIPE
+ * @return 1 if all sent, 0 if socket is full, -1 if error occured
+ */
+static int out_flush(client *c){
+    outqueue *o = &c->out;
+    while(o->cur < o->n){
+        struct msghdr msg = {.msg_iov = o->iov + o->cur, .msg_iovlen = o->n - o->cur};
+        ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            WARN("sendmsg()");
+            out_clear(c);
+            return -1;
+        }
+        o->sent += sent;
+        // skip parts already sent
+        while(o->cur < o->n && (size_t)sent >= o->iov[o->cur].iov_len){
+            sent -= o->iov[o->cur].iov_len;
+            ++o->cur;
+        }
+        if(o->cur < o->n){
+            o->iov[o->cur].iov_base = (uint8_t*)o->iov[o->cur].iov_base + sent;
+            o->iov[o->cur].iov_len -= sent;
+        }
+    }
+    out_clear(c);
+    return 1;
+}
+
+/**
+ * Check whether client receives data (socket buffer could grow while
+ * client doesn't read)
+ * @return 1 if client got something since last check
+ */
+static int out_progress(client *c){
+    outqueue *o = &c->out;
+    int q;
+    if(ioctl(c->fd, SIOCOUTQ, &q) || q < 0) return 0;
+    uint64_t acked = o->sent - (uint64_t)q;
+    if(acked <= o->acked) return 0;
+    o->acked = acked;
+    return 1;
+}
+
+/**
+ * Send answer to client: `iov[0]` is web header (if `web` is set), answer to
+ * HEAD request is header only; parts of answer should be in `c->out` buffers
+ * or in image/product referenced by it, what isn't sent at once will be sent
+ * by server
+ * @return 1 if all OK
+ */
+static int send_web(client *c, const httpreq *web, struct iovec *iov, int n){
+    outqueue *o = &c->out;
+    if(web && web->method == HTTP_HEAD) n = 1;
+    o->cur = o->n = 0;
+    for(int i = 0; i < n; ++i)
+        if(iov[i].iov_len) o->iov[o->n++] = iov[i];
+    o->tlast = dtime();
+    return (out_flush(c) > -1);
+}
+
+// send short text answer (with web header, `web` is NULL for non-web clients)
+static void send_text(client *c, const httpreq *web, int status, const char *txt){
+    int L = snprintf(c->out.hdr, BUFLEN, "%s", txt);
+    if(L >= BUFLEN) L = BUFLEN - 1;
+    int Len = http_hdr(c->out.web, BUFLEN, web, status, "text/plain", L);
+    if(Len < 0) return;
+    struct iovec iov[2] = {{c->out.web, Len}, {c->out.hdr, L}};
+    send_web(c, web, iov, 2);
+}
+
+/**
+ * Send raw image `im` with number `id`
+ * @return 1 if all OK
+ */
+static int send_ima(client *c, const httpreq *web, imstorage *im, uint64_t id){
+    char *buf = c->out.hdr, *bptr = buf, *obuff = c->out.web;
+    int Len, rest = BUFLEN;
+    size_t imS = im->W * im->H * sizeof(uint16_t);
+    #define PUT(key, val) do{Len = snprintf(bptr, rest, "%s=%i\n", key, (int)im->val); \
                 if(Len > 0){rest -= Len; bptr += Len;}}while(0)
+    Len = snprintf(bptr, rest, "imctr=%llu\n", (unsigned long long)id);
+    if(Len > 0){rest -= Len; bptr += Len;}
     PUT("binning", binning);
-    if(storedima->binning == 0xff){
+    if(im->binning == 0xff){
         PUT("subX", subframe->Xstart);
-        PUT("subY", subframe->Xstart);
+        PUT("subY", subframe->Ystart);
         PUT("subS", subframe->size);
     }
-    Len = snprintf((char*)bptr, rest, "%s=%g\n", "exptime", storedima->exptime);
+    Len = snprintf(bptr, rest, "%s=%g\n", "exptime", im->exptime);
     if(Len > 0){rest -= Len; bptr += Len;}
     PUT("imtype", imtype);
     PUT("imW", W);
     PUT("imH", H);
     PUT("exposetime", exposetime);
-    Len = snprintf((char*)bptr, rest, "imdata=");
-    if(Len){rest -= Len; bptr += Len;}
-    if(rest < imS){
-        red("rest = %d, need %d\n", rest, imS);
-        return 0; // not enough memory - HOW???
-    }
-    if(!memcpy(bptr, storedima->imdata, imS)){
-        WARN("memcpy()");
+    if(im->rowmask){ // partial image: send mask of rows
+        PUT("partial", badrows);
+        Len = snprintf(bptr, rest, "rowmask=");
+        if(Len > 0){rest -= Len; bptr += Len;}
+        for(size_t y = 0; y < im->H && rest > 1; ++y, --rest)
+            *bptr++ = im->rowmask[y] ? '1' : '0';
+        *bptr++ = '\n'; --rest;
+    }
+    Len = snprintf(bptr, rest, "imdata=");
+    if(Len >= rest){
+        WARNX("Image header too long");
         return 0;
     }
-    rest -= imS;
-    // send data
-    int send = BUFLEN10 - rest;
-    // OK buffer ready, prepare to send it
-    if(webquery){
-        Len = addwebhdr((char*)obuff, BUFLEN, "multipart/form-data", send);
+    rest -= Len;
+    // headers are in buffers, image data is sent directly from storage
+    size_t hlen = BUFLEN - rest;
+    struct iovec iov[3] = {{obuff, 0}, {buf, hlen}, {im->imdata, imS}};
+    if(web){
+        Len = http_hdr(obuff, BUFLEN, web, 200, "multipart/form-data", hlen + imS);
         if(Len < 0){
             WARN("sprintf()");
             return 0;
         }
-        if(Len != write(sock, obuff, Len)){
-            WARN("write");
+        iov[0].iov_len = Len;
+        DBG("%s", obuff);
+    }
+    red("send %zd bytes\n", iov[0].iov_len + hlen + imS);
+    if(!send_web(c, web, iov, 3)) return 0;
+    putlog("image %llu sent to client", (unsigned long long)id);
+    return 1;
+}
+
+/**
+ * Compress image of frame `f` (only by first call, other callers wait for it)
+ * @return 0 if compressed data is ready, 1 if it's not less than raw
+ */
+static int frame_rice(frame *f){
+    imstorage *im = &f->im;
+    size_t npix = im->W * im->H, rawlen = proto_rawlen(im);
+    pthread_mutex_lock(&f->ricemutex);
+    if(!f->ricelen){
+        size_t need = rice_bound(npix) + (im->rowmask ? im->H : 0);
+        if(need > f->ricesize){
+            FREE(f->rice);
+            f->rice = MALLOC(uint8_t, need);
+            f->ricesize = need;
+        }
+        double t0 = dtime();
+        size_t L = rice_encode(im->imdata, im->W, im->H, colour_step(im->binning), f->rice);
+        if(im->rowmask){
+            memcpy(f->rice + L, im->rowmask, im->H);
+            L += im->H;
+        }
+        f->ricecrc = proto_crc(f->rice, L, 0);
+        f->ricelen = L;
+        double t = dtime() - t0;
+        putlog("Image %llu compressed: ratio %.2f, %.1f MB/s", (unsigned long long)f->id,
+               (double)rawlen / L, t > 0. ? npix * sizeof(uint16_t) / t / 1e6 : 0.);
+    }
+    int ret = (f->ricelen >= rawlen);
+    pthread_mutex_unlock(&f->ricemutex);
+    return ret;
+}
+
+// @return 1 if images `a` and `b` have the same geometry
+static int samegeometry(const imstorage *a, const imstorage *b){
+    if(a->W != b->W || a->H != b->H || a->binning != b->binning) return 0;
+    if(!a->subframe || !b->subframe) return !a->subframe && !b->subframe;
+    return a->subframe->Xstart == b->subframe->Xstart && a->subframe->Ystart == b->subframe->Ystart
+            && a->subframe->size == b->subframe->size;
+}
+
+/**
+ * Compress image of frame `f` by previous image (only by first call)
+ * @return 0 if compressed data is ready, 1 if previous image is out of ring
+ *      or has another geometry, or if data isn't less than compressed image itself
+ */
+static int frame_delta(frame *f){
+    if(frame_rice(f)) return 1; // noise only: there's no sense to compress
+    imstorage *im = &f->im;
+    size_t npix = im->W * im->H;
+    int ret = 1;
+    pthread_mutex_lock(&f->ricemutex);
+    if(!f->deltalen){
+        frame *ref = frame_get(f->id - 1);
+        if(ref && samegeometry(im, &ref->im)){
+            size_t need = sizeof(uint64_t) + rice_bound(npix) + (im->rowmask ? im->H : 0);
+            if(need > f->deltasize){
+                FREE(f->delta);
+                f->delta = MALLOC(uint8_t, need);
+                f->deltasize = need;
+            }
+            double t0 = dtime();
+            uint64_t refid = htole64(ref->id);
+            memcpy(f->delta, &refid, sizeof(refid));
+            size_t L = sizeof(refid);
+            L += rice_encode_delta(im->imdata, ref->im.imdata, im->W, im->H, colour_step(im->binning), f->delta + L);
+            if(im->rowmask){
+                memcpy(f->delta + L, im->rowmask, im->H);
+                L += im->H;
+            }
+            f->deltacrc = proto_crc(f->delta, L, 0);
+            f->deltalen = L;
+            double t = dtime() - t0;
+            putlog("Image %llu compressed by previous: ratio %.2f, %.1f MB/s", (unsigned long long)f->id,
+                   (double)proto_rawlen(im) / L, t > 0. ? npix * sizeof(uint16_t) / t / 1e6 : 0.);
+        }
+        frame_put(ref);
+    }
+    if(f->deltalen) ret = (f->deltalen >= f->ricelen);
+    pthread_mutex_unlock(&f->ricemutex);
+    return ret;
+}
+
+/**
+ * Send raw image of frame `f` in binary format (pixels compressed by `codec`)
+ * @param delta - client has previous image, so `f` could be sent compressed by it
+ * @return 1 if all OK (2 if image was sent compressed by previous)
+ */
+static int send_imabin(client *c, const httpreq *web, int codec, int delta, frame *f){
+    imstorage *im = &f->im;
+    char *obuff = c->out.web;
+    proto_hdr *h = &c->out.bin;
+    size_t paylen = proto_rawlen(im), imS = im->W * im->H * sizeof(uint16_t);
+    struct iovec iov[4] = {{obuff, 0}, {h, sizeof(proto_hdr)}, {im->imdata, imS}, {im->rowmask, paylen - imS}};
+    if(codec == PROTO_DELTA && delta && !frame_delta(f)){
+        paylen = f->deltalen;
+        proto_mkhdr(h, im, f->id, PROTO_RAW, paylen, f->deltacrc);
+        h->codec = PROTO_DELTA;
+        iov[2].iov_base = f->delta;
+        iov[2].iov_len = paylen;
+        iov[3].iov_len = 0;
+    }else if(codec != PROTO_PLAIN && !frame_rice(f)){
+        paylen = f->ricelen;
+        proto_mkhdr(h, im, f->id, PROTO_RAW, paylen, f->ricecrc);
+        h->codec = PROTO_RICE;
+        iov[2].iov_base = f->rice;
+        iov[2].iov_len = paylen;
+        iov[3].iov_len = 0;
+    }else proto_mkhdr(h, im, f->id, PROTO_RAW, paylen, f->crc);
+    if(web){
+        int Len = http_hdr(obuff, BUFLEN, web, 200, "application/octet-stream", sizeof(proto_hdr) + paylen);
+        if(Len < 0){
+            WARN("sprintf()");
             return 0;
         }
-        DBG("%s", obuff);
+        iov[0].iov_len = Len;
     }
-    red("send %d bytes\n", send);
-    if(send != write(sock, buf, send)){
-        WARN("write()");
+    int ret = (h->codec == PROTO_DELTA) ? 2 : 1;
+    uint64_t id = f->id; // `f` could be released after sending
+    if(!send_web(c, web, iov, 4)) return 0;
+    putlog("image %llu sent to client", (unsigned long long)id);
+    return ret;
+}
+
+/**
+ * Send product (encoded image) `t` of image `im` with number `id`
+ * @return 1 if all OK
+ */
+static int send_product(client *c, const httpreq *web, int proto, product_type t, imstorage *im, uint64_t id){
+    product *p = product_get(t, im, id);
+    if(!p){
+        WARNX(_("Can't make %s"), product_name(t));
         return 0;
     }
-    putlog("image sent to client");
+    c->out.p = p; // released after sending
+    char *hdr = c->out.web;
+    proto_hdr *h = &c->out.bin;
+    int Len;
+    struct iovec iov[3] = {{hdr, 0}, {h, 0}, {p->data, p->len}};
+    if(proto){ // binary header (after web header if needed)
+        proto_mkhdr(h, im, id, PROTO_PRODUCT + t, p->len, p->crc);
+        iov[1].iov_len = sizeof(proto_hdr);
+        Len = web ? http_hdr(hdr, BUFLEN, web, 200, "application/octet-stream", sizeof(proto_hdr) + p->len) : 0;
+    }else if(web) Len = http_hdr(hdr, BUFLEN, web, 200, product_mime(t), p->len);
+    else Len = snprintf(hdr, BUFLEN, "product=%s\nimctr=%llu\nexposetime=%ld\nsize=%zd\nimdata=",
+                        product_name(t), (unsigned long long)p->imctr, (long)im->exposetime, p->len);
+    if(Len < 0) return 0;
+    iov[0].iov_len = Len;
+    if(!send_web(c, web, iov, 3)) return 0;
+    putlog("%s sent to client", product_name(t));
     return 1;
 }
 
@@ -230,115 +757,645 @@ char* stringscan(char *str, char *needle){
     return a;
 }
 
-void *handle_socket(void *asock){
-    FNAME();
-    uint64_t locctr = 0;
-    int sock = *((int*)asock);
-    int webquery = 0; // whether query is web or regular
-    char buff[BUFLEN];
-    ssize_t _read;
+/**
+ * Send image `id` as raw data or product `c->prodtype` (no locks held while
+ * sending; image is referenced by client's output queue till it's sent)
+ * @param delta - client has image `id`-1 (for delta codec)
+ * @return 1 if all OK (2 if image sent compressed by previous), 0 if send failed,
+ *      -1 if there's no such image in ring
+ */
+static int send_frame(client *c, int delta, uint64_t id){
+    const httpreq *web = c->webquery ? &c->http : NULL;
+    frame *f = frame_get(id);
+    if(!f) return -1;
+    c->out.f = f;
+    int ret;
+    if(c->prodtype > -1) ret = send_product(c, web, c->proto, c->prodtype, &f->im, id);
+    else if(c->proto) ret = send_imabin(c, web, c->codec, delta, f);
+    else ret = send_ima(c, web, &f->im, id);
+    if(!ret) out_clear(c);
+    return ret;
+}
+
+
+// queue of clients between server & senders
+typedef struct{
+    client *first, *last;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} clqueue;
+
+static clqueue jobq = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static clqueue doneq = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static int epfd = -1;       // epoll
+static int donefd = -1;     // eventfd: sender returned client
+static client **clients = NULL; // clients by their fd
+static int clientsL = 0;
+static time_t boottime = 0; // time of server start (ETag of images from previous run differs)
+
+static void clq_push(clqueue *q, client *c){
+    c->next = NULL;
+    pthread_mutex_lock(&q->mutex);
+    if(q->last) q->last->next = c;
+    else q->first = c;
+    q->last = c;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// get first client from queue (wait for it if `wait` is set)
+static client *clq_pop(clqueue *q, int wait){
+    pthread_mutex_lock(&q->mutex);
+    while(wait && !q->first) pthread_cond_wait(&q->cond, &q->mutex);
+    client *c = q->first;
+    if(c){
+        q->first = c->next;
+        if(!q->first) q->last = NULL;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return c;
+}
+
+// name of format of images client gets (for ETag & routes)
+static const char *imformat(client *c){
+    if(c->prodtype > -1) return product_name(c->prodtype);
+    if(c->proto) return (c->codec == PROTO_PLAIN) ? "bin" : "rice";
+    return "raw";
+}
+
+/**
+ * Set format of images by its name (for routes): "raw" (text header & pixels),
+ * "bin" (binary protocol), "rice" (binary protocol, compressed pixels) or product
+ * @return 0 if all OK
+ */
+static int set_imformat(client *c, const char *name){
+    if(0 == strcmp(name, "raw")) return 0;
+    if(0 == strcmp(name, "bin") || 0 == strcmp(name, "rice")){
+        c->proto = PROTO_VERSION;
+        c->codec = (*name == 'r') ? PROTO_RICE : PROTO_PLAIN;
+        return 0;
+    }
+    for(int t = 0; t < PRODUCT_AMOUNT; ++t)
+        if(0 == strcmp(name, product_name(t))){
+            if(!product_supported(t)) return 1;
+            c->prodtype = t;
+            return 0;
+        }
+    return 1;
+}
+
+/**
+ * Web query is done
+ * @return 1 if client should be disconnected
+ */
+static int web_done(client *c){
+    c->streaming = 0; // wait for next request
+    return !c->http.keepalive;
+}
+
+/**
+ * Send one image `c->frameid` (the newest if it's zero)
+ * @return 1 if client should be disconnected
+ */
+static int send_one(client *c){
+    const httpreq *web = c->webquery ? &c->http : NULL;
+    uint64_t first, last = ring_range(&first), id = c->frameid ? c->frameid : last;
+    int sent = -1;
+    if(web){ // image `id` in given format never changes
+        snprintf(c->http.etag, HTTP_ETAGLEN, "\"%lx-%llu.%s\"", (long)boottime, (unsigned long long)id, imformat(c));
+        if(http_notmodified(web)){
+            int Len = http_hdr(c->out.web, BUFLEN, web, 304, NULL, 0);
+            struct iovec iov = {c->out.web, Len};
+            sent = (Len > 0 && send_web(c, NULL, &iov, 1));
+            DBG("image %llu not modified", (unsigned long long)id);
+        }
+    }
+    if(sent < 0) sent = send_frame(c, 0, id);
+    if(sent < 0){
+        char buff[BUFLEN];
+        snprintf(buff, BUFLEN, "NO FRAME %llu\nfirst=%llu\nlast=%llu\n", (unsigned long long)id,
+                 (unsigned long long)first, (unsigned long long)last);
+        c->http.etag[0] = 0;
+        send_text(c, web, c->route ? 404 : 200, buff);
+    }
+    if(!sent || !web) return 1;
+    return web_done(c);
+}
+
+/**
+ * Send new events (or comment if there's no events since EVENTS_PING seconds)
+ * @return 1 if client should be disconnected
+ */
+static int send_events(client *c){
+    char *buf = c->out.hdr;
+    size_t L = events_get(&c->evid, buf, BUFLEN);
+    if(!L) L = snprintf(buf, BUFLEN, ": ping\n\n");
+    struct iovec iov = {buf, L};
+    if(!send_web(c, NULL, &iov, 1)) return 1;
+    c->tlast = dtime();
+    return 0;
+}
+
+/**
+ * Send all images client waits for (till socket buffer is full: the rest is
+ * sent by server when client is ready to receive it)
+ * @return 1 if client should be disconnected (after answer is sent)
+ */
+static int send_pending(client *c){
+    if(c->events) return send_events(c);
+    if(c->oneshot) return send_one(c); // send one image from ring
+    uint64_t oldest, last;
+    // send all images from ring client didn't get yet
+    while(!c->out.n && (last = ring_range(&oldest)) > c->locctr){
+        uint64_t id = c->locctr + 1;
+        if(!c->locctr && !c->since) id = last; // new client gets only last image
+        else if(id < oldest){
+            putlog("Client missed %llu images", (unsigned long long)(oldest - id));
+            id = oldest;
+        }
+        DBG("Send image, imctr = %llu, id = %llu", (unsigned long long)last, (unsigned long long)id);
+        // delta codec: image could be compressed by previous one client already has
+        int delta = (c->refid && id == c->refid + 1 && c->keyctr < keyframes - 1);
+        int sent = send_frame(c, delta, id);
+        if(sent < 0) continue; // went out of ring just now
+        if(!sent) return 1;
+        c->keyctr = (sent == 2) ? c->keyctr + 1 : 0;
+        c->locctr = c->refid = id;
+        if(c->webquery) return web_done(c); // end of transmission
+    }
+    return 0;
+}
+
+static void *sender(void _U_ *arg){
     while(1){
-        int rd = waittoread(sock);
-        if(rd < 0){
-            putlog("Disconnected");
-            break;
+        client *c = clq_pop(&jobq, 1);
+        c->close = send_pending(c);
+        clq_push(&doneq, c);
+        evnotify(donefd);
+    }
+    return NULL;
+}
+
+// stop watching client
+static void unwatch_client(client *c){
+    if(!c->evmask) return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->evmask = 0;
+}
+
+// give client to sender
+static void dispatch(client *c){
+    c->busy = 1;
+    unwatch_client(c);
+    clq_push(&jobq, c);
+}
+
+// wait for client's requests or for place in its socket buffer for the rest of answer;
+// streaming web client with full input buffer isn't watched: its requests wait in socket
+static void watch_client(client *c){
+    uint32_t mask = c->out.n ? EPOLLOUT : (c->rlen < BUFLEN - 1 ? EPOLLIN : 0);
+    if(!mask){
+        unwatch_client(c);
+        return;
+    }
+    if(mask == c->evmask) return;
+    struct epoll_event ev = {.events = mask, .data.fd = c->fd};
+    if(epoll_ctl(epfd, c->evmask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev)) WARN("epoll_ctl()");
+    c->evmask = mask;
+}
+
+static void close_client(client *c){
+    DBG("close fd %d", c->fd);
+    unwatch_client(c);
+    out_clear(c);
+    close(c->fd);
+    clients[c->fd] = NULL;
+    FREE(c);
+}
+
+static void new_client(int sock){
+    socklen_t size = sizeof(struct sockaddr_in);
+    struct sockaddr_in their_addr;
+    int fd = accept4(sock, (struct sockaddr*)&their_addr, &size, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(fd < 0){
+        WARN("accept()");
+        return;
+    }
+    putlog("Got connection from %s\n", inet_ntoa(their_addr.sin_addr));
+    if(fd >= clientsL){
+        int L = fd + 64;
+        client **n = realloc(clients, L * sizeof(client*));
+        if(!n){
+            WARN("realloc()");
+            close(fd);
+            return;
         }
-        if(!rd){ // no data incoming
-            pthread_mutex_lock(&mutex);
-            if(imctr != locctr){
-                red("Send image, imctr = %ld, locctr = %ld\n", imctr, locctr);
-                if(send_ima(sock, webquery)){
-                    locctr = imctr;
-                    if(webquery){
-                        pthread_mutex_unlock(&mutex);
-                        break; // end of transmission
-                    }
-                }
-            }
-            pthread_mutex_unlock(&mutex);
-            continue;
+        memset(n + clientsL, 0, (L - clientsL) * sizeof(client*));
+        clients = n;
+        clientsL = L;
+    }
+    client *c = MALLOC(client, 1);
+    c->fd = fd;
+    c->prodtype = -1;
+    c->tconn = c->tlast = dtime();
+    clients[fd] = c;
+    watch_client(c);
+}
+
+// send daemon's state
+static void send_status(client *c){
+    char buff[BUFLEN];
+    const char *fw = get_firmvare_cached();
+    uint64_t first, last = ring_range(&first);
+    snprintf(buff, BUFLEN, "state=%s\nspeed=%d\nfirmware=%s\nimctr=%llu\nfirst=%llu\nduty=%.3f\n",
+             cam_statename(cam_getstate()), get_curspeed(), fw ? fw : "unknown",
+             (unsigned long long)last, (unsigned long long)first, duty);
+    send_text(c, c->webquery ? &c->http : NULL, 200, buff);
+}
+
+// text answer is sent: @return 1 if client should be disconnected
+static int answered(client *c){
+    return c->webquery ? web_done(c) : 1;
+}
+
+/**
+ * Process client's request by parameters `found` ("name=value" anywhere)
+ * @return 1 if client should be disconnected
+ */
+static int client_params(client *c, char *found){
+    const httpreq *web = c->webquery ? &c->http : NULL;
+    char buff[BUFLEN];
+    // here we can process user data
+    printf("user send: %s\n", found);
+    long htr;
+    if(getintpar((uint8_t*)found, "heater", &htr)){
+        putlog("got command: heater=%ld", htr);
+        if(htr == 0) heater_off();
+        else heater_on();
+        snprintf(buff, BUFLEN, "HEATER %s\r\n", htr ? "ON " : "OFF");
+        send_text(c, web, 200, buff);
+        return answered(c); // disconnect after command receiving
+    }
+    if(getintpar((uint8_t*)found, "abort", &htr)){
+        putlog("got command: abort");
+        cam_abort();
+        send_text(c, web, 200, "ABORTED\r\n");
+        return answered(c);
+    }
+    uint8_t *prod = findpar((uint8_t*)found, "product");
+    if(prod){ // client wants encoded image instead of raw
+        char pname[16];
+        int i = 0;
+        for(; i < 15 && isalpha(prod[i]); ++i) pname[i] = prod[i];
+        pname[i] = 0;
+        c->prodtype = product_bytype(pname);
+        if(c->prodtype < 0 || !product_supported(c->prodtype)){
+            putlog("Product %s not supported", pname);
+            send_text(c, web, 200, "PRODUCT NOT SUPPORTED\r\n");
+            return answered(c);
         }
-        _read = read(sock, buff, BUFLEN);
-        if(_read < 1){ // error or disconnect
-            putlog("Client disconnected");
-            DBG("Nothing to read from fd %d (ret: %zd)", sock, _read);
-            break;
+    }
+    if(getintpar((uint8_t*)found, "proto", &htr)){ // client understands binary protocol
+        c->proto = (htr >= PROTO_VERSION) ? PROTO_VERSION : 0;
+        DBG("proto: %d", c->proto);
+    }
+    uint8_t *codec = findpar((uint8_t*)found, "codec");
+    if(codec && c->proto && 0 == strncmp((char*)codec, "rice", 4)){ // client wants compressed images
+        c->codec = PROTO_RICE;
+        putlog("Client wants compressed images");
+    }else if(codec && c->proto && 0 == strncmp((char*)codec, "delta", 5)){ // ... and compressed by previous
+        c->codec = PROTO_DELTA;
+        putlog("Client wants images compressed by previous");
+    }
+    if(getintpar((uint8_t*)found, "frame", &htr)){ // send one image from ring
+        c->oneshot = 1;
+        c->frameid = (htr > 0) ? (uint64_t)htr : 0; // 0 - the newest
+    }
+    if(getintpar((uint8_t*)found, "since", &htr)){ // stream all images after given
+        c->locctr = (htr > 0) ? (uint64_t)htr : 0;
+        c->since = 1;
+        putlog("Client wants images since %llu", (unsigned long long)c->locctr);
+    }
+    if(getintpar((uint8_t*)found, "status", &htr)){
+        send_status(c);
+        return answered(c);
+    }
+    if(c->webquery && !c->since) c->oneshot = 1; // web client gets one image (the newest by default)
+    c->streaming = 1;
+    return 0;
+}
+
+/**
+ * Process HTTP request `req` of length `L`; routes:
+ *      status              - daemon's state
+ *      events              - stream of events (text/event-stream)
+ *      latest.<format>     - the newest image
+ *      frame/<N>.<format>  - image number N (if it's still in ring)
+ * (format is "raw", "bin", "rice", "fits", "tiff" or "jpeg"),
+ * other requests are processed by parameters in path & body
+ * @return 1 if client should be disconnected
+ */
+static int web_request(client *c, char *req, size_t L){
+    // each request on keep-alive connection starts from scratch
+    c->webquery = 1;
+    c->route = c->oneshot = c->since = c->proto = c->codec = 0;
+    c->prodtype = -1;
+    c->frameid = c->locctr = c->refid = 0;
+    if(http_parse(req, L, &c->http)){
+        putlog("Bad HTTP request");
+        send_text(c, NULL, 400, "BAD REQUEST\r\n");
+        return 1;
+    }
+    char path[HTTP_PATHLEN + 1], *fmt = NULL;
+    snprintf(path, sizeof(path), "%s", c->http.path);
+    char *query = strchr(path, '?');
+    if(query) *query++ = 0;
+    DBG("path: %s, query: %s", path, query);
+    if(0 == strcmp(path, "status")){
+        send_status(c);
+        return answered(c);
+    }
+    if(0 == strcmp(path, "events")){ // answer lasts till disconnect
+        c->http.keepalive = 0;
+        int Len = http_hdr(c->out.web, BUFLEN, &c->http, 200, "text/event-stream", HTTP_NOLENGTH);
+        struct iovec iov = {c->out.web, Len};
+        if(Len < 0 || !send_web(c, &c->http, &iov, 1)) return 1;
+        if(c->http.method == HTTP_HEAD) return 1;
+        // reconnected client gets events it missed
+        uint64_t last = events_last();
+        c->evid = (c->http.lastevent > -1 && (uint64_t)c->http.lastevent <= last) ? (uint64_t)c->http.lastevent : last;
+        c->events = 1;
+        c->streaming = 1;
+        c->tlast = dtime();
+        putlog("Client wants events since %llu", (unsigned long long)c->evid);
+        return 0;
+    }
+    if(0 == strncmp(path, "latest.", 7)) fmt = path + 7;
+    else if(0 == strncmp(path, "frame/", 6)){
+        char *e;
+        unsigned long long id = strtoull(path + 6, &e, 10);
+        if(e != path + 6 && *e == '.' && id){
+            c->frameid = id;
+            fmt = e + 1;
+        }else fmt = "";
+    }
+    if(fmt){ // route
+        c->route = 1;
+        c->oneshot = 1;
+        if(set_imformat(c, fmt)){
+            send_text(c, &c->http, 404, "NOT FOUND\r\n");
+            return answered(c);
         }
-        DBG("Got %zd bytes", _read);
-        // add trailing zero to be on the safe side
-        buff[_read] = 0;
-        // now we should check what do user want
-        char *got, *found = buff;
-        if((got = stringscan(buff, "GET")) || (got = stringscan(buff, "POST"))){ // web query
-            webquery = 1;
-            char *slash = strchr(got, '/');
-            if(slash) found = slash + 1;
-            // web query have format GET /some.resource
-        }
-        // here we can process user data
-        printf("user send: %s\n", found);
-        long htr;
-        // double dd;
-        //if(getdpar((uint8_t*)found, "exptime", &dd)) printf("exptime: %g\n", dd);
-        if(getintpar((uint8_t*)found, "heater", &htr)){
-            putlog("got command: heater=%ld", htr);
-            if(htr == 0) heater_off();
-            else heater_on();
-            int Len = addwebhdr(buff, BUFLEN, "text/html", 12);
-            if(Len > 0){
-                Len += snprintf(buff+Len, BUFLEN, "HEATER %s\r\n", htr ? "ON " : "OFF");
-                write(sock, buff, Len);
-            }
-            break; // disconnect after command receiving
+        c->streaming = 1;
+        return 0;
+    }
+    if(*path && !strchr(path, '=') && !c->http.bodylen){
+        send_text(c, &c->http, 404, "NOT FOUND\r\n");
+        return answered(c);
+    }
+    // old style web query: GET /param=value or POST with parameters
+    char params[BUFLEN];
+    snprintf(params, BUFLEN, "%s\n%.*s", c->http.path, (int)c->http.bodylen, c->http.body ? c->http.body : "");
+    return client_params(c, params);
+}
+
+/**
+ * Process requests got from client (while it's not in hands of sender; next
+ * request of web client is processed after answer to previous one)
+ * @return 1 if client should be disconnected
+ */
+static int client_input(client *c){
+    while(c->rlen && !c->busy && !c->out.n && !(c->webquery && c->streaming)){
+        int ishttp = http_isreq(c->rbuf, c->rlen);
+        if(ishttp < 0) return 0; // wait for more data
+        size_t L = c->rlen;
+        if(ishttp && !(L = http_reqlen(c->rbuf, c->rlen, BUFLEN - 1))) return 0; // wait for rest of request
+        if(L == HTTP_TOOLONG){
+            putlog("Too long HTTP request");
+            send_text(c, NULL, 413, "REQUEST TOO LONG\r\n");
+            return 1;
         }
+        char req[BUFLEN];
+        memcpy(req, c->rbuf, L);
+        req[L] = 0; // add trailing zero to be on the safe side
+        c->rlen -= L;
+        memmove(c->rbuf, c->rbuf + L, c->rlen);
+        ++c->nreq;
+        int ret = ishttp ? web_request(c, req, L) : client_params(c, req);
+        if(ret) return 1;
     }
-    close(sock);
-    //DBG("closed");
-    pthread_exit(NULL);
-    return NULL;
+    return 0;
+}
+
+/**
+ * Read client's requests
+ * @return 1 if client disconnected
+ */
+static int client_request(client *c){
+    if(c->rlen >= BUFLEN - 1) return 0; // no place: requests are processed after answer
+    ssize_t _read = read(c->fd, c->rbuf + c->rlen, BUFLEN - 1 - c->rlen);
+    if(_read < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if(_read < 1){ // error or disconnect
+        putlog("Client disconnected");
+        DBG("Nothing to read from fd %d (ret: %zd)", c->fd, _read);
+        return 1;
+    }
+    DBG("Got %zd bytes", _read);
+    c->rlen += _read;
+    c->tlast = dtime();
+    return 0;
+}
+
+// give client to sender if it waits for images or events (and got previous answer)
+static void check_client(client *c){
+    if(c->busy || !c->streaming || c->out.n || c->close) return;
+    if(c->events){
+        if(events_last() > c->evid || dtime() - c->tlast > EVENTS_PING) dispatch(c);
+        return;
+    }
+    uint64_t last = ring_range(NULL);
+    if(c->oneshot ? (c->frameid || last) : last > c->locctr) dispatch(c);
+}
+
+/**
+ * Client isn't in hands of sender: wait till its answer is sent, then
+ * process its next requests and give it to sender if it waits for images
+ * (or disconnect it)
+ */
+static void client_next(client *c){
+    if(!c->out.n && !c->close) c->close = client_input(c);
+    if(!c->out.n && c->close){
+        close_client(c);
+        return;
+    }
+    check_client(c);
+    if(!c->busy) watch_client(c);
 }
 
 void *server(void *asock){
     int sock = *((int*)asock);
-    if(listen(sock, BACKLOG) == -1){
-        WARN("listen");
-        return NULL;
+    if(epfd < 0){
+        if(listen(sock, BACKLOG) == -1){
+            WARN("listen");
+            return NULL;
+        }
+        if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+            WARN("epoll_create1()");
+            return NULL;
+        }
+        int fds[4] = {sock, framefd, donefd, events_init()};
+        for(int i = 0; i < 4; ++i){
+            struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+            if(epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev)){
+                WARN("epoll_ctl()");
+                close(epfd);
+                epfd = -1;
+                return NULL;
+            }
+        }
     }
+    if(!boottime) boottime = time(NULL);
+    struct epoll_event events[MAXEVENTS];
+    int nwaiting = 0; // amount of new clients which didn't send request yet
+    int nidle = 0;    // amount of idle keep-alive connections
     while(1){
-        socklen_t size = sizeof(struct sockaddr_in);
-        struct sockaddr_in their_addr;
-        int newsock;
-        int rd = waittoread(sock);
-        if(rd < 0){
+        int n = epoll_wait(epfd, events, MAXEVENTS, nwaiting ? 100 : (nidle ? 1000 : -1));
+        if(n < 0){
+            if(errno == EINTR) continue;
+            WARN("epoll_wait()");
             putlog("Socket error");
             return NULL;
         }
-        if(!rd) continue;
-        red("Got connection\n");
-        newsock = accept(sock, (struct sockaddr*)&their_addr, &size);
-        if(newsock <= 0){
-            WARN("accept()");
-            continue;
+        for(int i = 0; i < n; ++i){
+            int fd = events[i].data.fd;
+            if(fd == sock){
+                red("Got connection\n");
+                new_client(sock);
+            }else if(fd == framefd || fd == events_init()){ // new image or event: wake up all waiting clients
+                evclear(fd);
+                for(int j = 0; j < clientsL; ++j)
+                    if(clients[j]) check_client(clients[j]);
+            }else if(fd == donefd){ // clients returned by senders
+                evclear(donefd);
+                client *c;
+                while((c = clq_pop(&doneq, 0))){
+                    c->busy = 0;
+                    client_next(c); // next web request or new images came while sending
+                }
+            }else{
+                client *c = (fd < clientsL) ? clients[fd] : NULL;
+                if(!c || c->busy) continue;
+                // send the rest of answer or read requests
+                if(c->out.n ? (out_flush(c) < 0) : client_request(c)) close_client(c);
+                else client_next(c);
+            }
         }
-        putlog("Got connection from %s\n", inet_ntoa(their_addr.sin_addr));
-        pthread_t handler_thread;
-        if(pthread_create(&handler_thread, NULL, handle_socket, (void*) &newsock))
-            WARN("pthread_create()");
-        else{
-            DBG("Thread created, detouch");
-            pthread_detach(handler_thread); // don't care about thread state
+        // clients without request get images after CLIENT_WAIT seconds,
+        // idle web clients are disconnected after HTTP_KEEPALIVE seconds,
+        // idle events streams get comment each EVENTS_PING seconds,
+        // clients which don't receive answer are disconnected after CLIENT_SNDTMOUT seconds
+        double t = dtime();
+        nwaiting = nidle = 0;
+        for(int j = 0; j < clientsL; ++j){
+            client *c = clients[j];
+            if(!c || c->busy) continue;
+            if(c->out.n){
+                if(out_progress(c)) c->out.tlast = t;
+                else if(t - c->out.tlast > CLIENT_SNDTMOUT){
+                    putlog("Client doesn't receive data, disconnect");
+                    close_client(c);
+                }else ++nidle;
+                continue;
+            }
+            if(c->events){
+                ++nidle;
+                check_client(c);
+                continue;
+            }
+            if(c->webquery || c->rlen){ // keep-alive connection or request isn't full yet
+                if(c->streaming) continue;
+                if(t - c->tlast > HTTP_KEEPALIVE){
+                    DBG("Close idle connection %d", c->fd);
+                    close_client(c);
+                }else ++nidle;
+                continue;
+            }
+            if(c->streaming || c->nreq) continue;
+            if(t - c->tconn > CLIENT_WAIT){
+                c->streaming = 1;
+                check_client(c);
+            }else ++nwaiting;
         }
     }
 }
 
+/**
+ * Prepare parameters of next image (exposition time & dark/light) and start
+ * exposition
+ * @param errcntr (io) - errors counter
+ * @return 0 if all OK
+ */
+static int start_next(imstorage *img, int *errcntr){
+    // correct exposition by sky brightness changes since image it was calculated by
+    double E, Etime;
+    if(get_exp_calculated(&E, &Etime))
+        img->exptime = ephem_exptime(E, Etime, dtime(), AE_MINEXP, get_max_exptime());
+    if(img->imtype != IMTYPE_AUTODARK){ // check for darks
+        if(img->imtype == IMTYPE_DARK){
+            putlog("First light frame after dark");
+            img->imtype = IMTYPE_LIGHT; // last was dark
+        }
+        else if(img->exptime > min_dark_exp && darklib_stale(img)){ // no fresh dark for this exposition
+            putlog("Take dark image for exptime=%gs", img->exptime);
+            img->imtype = IMTYPE_DARK;
+        }
+    }
+    if(start_exposition(img, NULL)){
+        putlog("Error starting exposition, try later");
+        event_post(EVENT_ERROR, "\"message\":\"Error starting exposition\"");
+        WARNX(_("Error starting exposition, try later"));
+        ++*errcntr;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Refresh sensor duty cycle by new exposition start
+ * @param exptime - exposition time of previous image
+ * @param period  - time between previous and current expositions start
+ */
+static void update_duty(double exptime, double period){
+    static int nframes = 0;
+    if(period <= 0.) return;
+    double d = exptime / period;
+    if(d > 1.) d = 1.;
+    if(duty < 0.) duty = d;
+    else duty += (d - duty) / 8.;
+    if(++nframes % DUTY_LOG_PERIOD == 0) putlog("Sensor duty cycle: %.1f%%", duty * 100.);
+}
+
 static void daemon_(imstorage *img, int sock){
     FNAME();
     if(sock < 0) return;
+    framefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(framefd < 0 || donefd < 0 || events_init() < 0) ERR("eventfd()");
+    for(int i = 0; i < SENDERS; ++i){
+        pthread_t sender_thread;
+        if(pthread_create(&sender_thread, NULL, sender, NULL))
+            ERR("pthread_create()");
+        pthread_detach(sender_thread);
+    }
     pthread_t sock_thread;
-    static double lastDT = 0.; // last time dark was taken
     if(pthread_create(&sock_thread, NULL, server, (void*) &sock))
         ERR("pthread_create()");
+    pthread_t worker_thread;
+    if(pthread_create(&worker_thread, NULL, pipe_worker, NULL))
+        ERR("pthread_create()");
+    pthread_detach(worker_thread);
     int errcntr = 0;
+    double expstart = -1., lastexp = 0.; // time of last exposition start and its exptime
     do{
         if(pthread_kill(sock_thread, 0) == ESRCH){ // died
             WARNX("Sockets thread died");
@@ -347,40 +1404,42 @@ static void daemon_(imstorage *img, int sock){
             if(pthread_create(&sock_thread, NULL, server, (void*) &sock))
                 ERR("pthread_create()");
         }
-        if(exp_calculated > 0.) img->exptime = exp_calculated;
-        if(img->imtype != IMTYPE_AUTODARK){ // check for darks
-            if(img->imtype == IMTYPE_DARK){
-                putlog("First light frame after dark");
-                img->imtype = IMTYPE_LIGHT; // last was dark
-            }
-            else if(img->exptime > min_dark_exp){ // need to store dark frame?
-                putlog("exptime > %g; dtime()=%.1f, lastDT = %.1f", min_dark_exp, dtime(), lastDT);
-                if(dtime() - lastDT > dark_interval){
-                    putlog("Take dark image");
-                    lastDT = dtime();
-                    img->imtype = IMTYPE_DARK;
+        // sleep until camera's answer, timeout or cam_abort()
+        switch(cam_process(1.)){
+            case CAM_EXPDONE: // image ready - get it
+                event_post(EVENT_READOUT, "\"exptime\":%g", img->exptime);
+                FREE(img->imdata);
+                cam_xfer(img); // in case of error state will be CAM_ERROR
+            break;
+            case CAM_READY: // give image to worker and start next exposition
+                errcntr = 0;
+                img->imdata = cam_getimage();
+                pipe_push(takeima(img));
+                if(term_checklink()){ // too many resends - change speed
+                    putlog("Can't restore connection");
+                    ERRX(_("Can't restore connection"));
                 }
-            }
-        }
-        if(start_exposition(img, NULL)){
-            putlog("Error starting exposition, try later");
-            WARNX(_("Error starting exposition, try later"));
-            ++errcntr;
-        }else{
-            FREE(img->imdata);
-            if(!get_imdata(img)){
+            break;
+            case CAM_ERROR:
                 ++errcntr;
                 putlog("Error image transfer");
+                event_post(EVENT_ERROR, "\"message\":\"Error image transfer\"");
                 WARNX(_("Error image transfer"));
-            }else{
-                errcntr = 0;
-                pthread_mutex_lock(&mutex);
-                if(copyima(img)){
-                    ++imctr;
-            if(img->imtype != IMTYPE_DARK)
-                    save_histo(NULL, img); // calculate next optimal exposition
+                if(term_checklink()){
+                    putlog("Can't restore connection");
+                    ERRX(_("Can't restore connection"));
                 }
-                pthread_mutex_unlock(&mutex);
+            break;
+            default: // exposition or transfer in progress
+            break;
+        }
+        cam_state st = cam_getstate();
+        if(st == CAM_IDLE || st == CAM_ERROR){ // camera is free - start next exposition
+            if(!start_next(img, &errcntr)){
+                double t = mtime();
+                if(expstart > 0.) update_duty(lastexp, t - expstart);
+                expstart = t;
+                lastexp = img->exptime;
             }
         }
         if(errcntr >= 33){
@@ -389,6 +1448,7 @@ static void daemon_(imstorage *img, int sock){
         }
     }while(1);
 }
+
 #endif
 
 #ifdef CLIENT
@@ -411,9 +1471,20 @@ static imstorage *get_imstorage(imstorage *img, uint8_t *buf, size_t L){
     if(getintpar(buf, "imW", &i)) img->W = i;
     if(getintpar(buf, "imH", &i)) img->H = i;
     if(getintpar(buf, "exposetime", &i)) img->exposetime = i;
-    uint8_t *par = findpar(buf, "imdata");
+    if(getintpar(buf, "imctr", &i)) putlog("Got image %ld", i);
+    FREE(img->rowmask);
+    img->badrows = 0;
+    uint8_t *par = findpar(buf, "rowmask");
+    if(par && getintpar(buf, "partial", &i)){ // partial image
+        img->badrows = i;
+        img->rowmask = MALLOC(uint8_t, img->H);
+        for(size_t y = 0; y < img->H && (par[y] == '0' || par[y] == '1'); ++y)
+            img->rowmask[y] = par[y] - '0';
+    }
+    par = findpar(buf, "imdata");
     if(par){
         img->imdata = (uint16_t*)par;
+        forget_stat(); // new data in the same buffer
         size_t datasz = img->W * img->H * sizeof(uint16_t);
         if(datasz > L - (par - buf)) return NULL; // buffer too small for given image
         DBG("1st pix: %u; W=%zd, H=%zd", *img->imdata, img->W, img->H);
@@ -421,9 +1492,249 @@ static imstorage *get_imstorage(imstorage *img, uint8_t *buf, size_t L){
     return img;
 }
 
+static int cproduct = -1; // product to request from daemon or -1 for raw image
+static long long cframe = -1, csince = -1; // image number(s) to request from daemon's ring
+static int ccompress = PROTO_PLAIN; // codec of images requested
+
+/**
+ * Ask daemon for encoded image `name` (fits, tiff or jpeg) instead of raw image
+ * @return 0 if all OK
+ */
+int set_product(const char *name){
+    if(!name) return 0;
+    cproduct = product_bytype(name);
+    if(cproduct < 0){
+        WARNX(_("Wrong product: %s, should be \"fits\", \"tiff\" or \"jpeg\""), name);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Ask daemon for image number `frame` only or for all images after `since`
+ * (negative values are ignored)
+ */
+void set_frames(long long frame, long long since){
+    cframe = frame;
+    csince = since;
+}
+
+/**
+ * Ask daemon for compressed images (if `rice` is set) or for images compressed
+ * by previous ones (if `delta` is set)
+ */
+void set_compress(int rice, int delta){
+    ccompress = delta ? PROTO_DELTA : (rice ? PROTO_RICE : PROTO_PLAIN);
+}
+
+/**
+ * Store product `t` got from daemon
+ * @return 0 if all OK
+ */
+static int write_product(imstorage *img, product_type t, uint8_t *data, size_t size){
+    char *name = make_filename(img, product_suffix(t));
+    if(!name) return 1;
+    if(*name == '!') ++name; // cfitsio's "rewrite" mark
+    FILE *f = fopen(name, "w");
+    if(!f){
+        WARN(_("Can't open %s"), name);
+        return 1;
+    }
+    int ret = (size != fwrite(data, 1, size, f));
+    fclose(f);
+    if(ret) return 1;
+    green(_("Image %s saved\n"), name);
+    modifytimestamp(name, img);
+    return 0;
+}
+
+/**
+ * Store product got from daemon in text format
+ * @return 0 if all OK
+ */
+static int store_product(imstorage *img, uint8_t *buf, size_t L){
+    long i;
+    if(!findpar(buf, "product")){
+        WARNX(_("Daemon can't make %s"), product_name(cproduct));
+        return 1;
+    }
+    if(!getintpar(buf, "size", &i) || i < 1) return 1;
+    size_t size = i;
+    if(getintpar(buf, "exposetime", &i)) img->exposetime = i;
+    uint8_t *data = findpar(buf, "imdata");
+    if(!data || size > L - (data - buf)) return 1;
+    return write_product(img, cproduct, data, size);
+}
+
+/**
+ * Read exactly `len` bytes from socket
+ * @return 0 if all OK
+ */
+static int read_exact(int sock, uint8_t *buf, size_t len){
+    int idle = 0;
+    while(len){
+        int rd = waittoread(sock);
+        if(rd < 0) return 1;
+        if(!rd){
+            if(++idle > READ_TMOUT){
+                putlog("Timeout reading data");
+                return 1;
+            }
+            continue;
+        }
+        idle = 0;
+        ssize_t n = read(sock, buf, len);
+        if(n < 1){
+            if(n < 0 && errno == EINTR) continue;
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Read frame of binary protocol (its first 4 bytes are already in `*buf`)
+ * and store image
+ * @param buf, bufsiz (io) - receiving buffer (could be reallocated)
+ * @return 1 if connection broken
+ */
+static int get_frame(imstorage *img, int sock, uint8_t **buf, size_t *bufsiz){
+    static imsubframe F;
+    // last image got (reference for delta codec)
+    static uint16_t *ref = NULL;
+    static size_t refsize = 0;
+    static proto_hdr refhdr;
+    static uint64_t refid = 0;
+    proto_hdr h;
+    if(read_exact(sock, *buf + sizeof(uint32_t), sizeof(proto_hdr) - sizeof(uint32_t))) return 1;
+    if(proto_gethdr(*buf, sizeof(proto_hdr), &h)){
+        WARNX(_("Bad frame header"));
+        return 1;
+    }
+    size_t extra = h.hdrlen - sizeof(proto_hdr); // header fields of next protocol versions
+    if(extra + h.paylen > *bufsiz){
+        uint8_t *n = realloc(*buf, extra + h.paylen);
+        if(!n){
+            WARN("realloc()");
+            return 1;
+        }
+        *buf = n;
+        *bufsiz = extra + h.paylen;
+    }
+    if(read_exact(sock, *buf, extra + h.paylen)) return 1;
+    uint8_t *data = *buf + extra;
+    if(proto_crc(data, h.paylen, 0) != h.crc){
+        putlog("Wrong checksum of image %llu", (unsigned long long)h.frameid);
+        WARNX(_("Wrong checksum of image %llu"), (unsigned long long)h.frameid);
+        refid = 0; // next images compressed by this one are lost till key image
+        return 0;
+    }
+    putlog("Got image %llu", (unsigned long long)h.frameid);
+    img->exposetime = h.exposetime;
+    int ret;
+    if(h.payload >= PROTO_PRODUCT){
+        int t = h.payload - PROTO_PRODUCT;
+        if(t >= PRODUCT_AMOUNT) return 0;
+        ret = write_product(img, t, data, h.paylen);
+    }else{
+        size_t npix = (size_t)h.W * h.H, imS = npix * sizeof(uint16_t), masklen = h.badrows ? h.H : 0;
+        uint8_t *mask = data + imS;
+        if(h.codec == PROTO_RICE || h.codec == PROTO_DELTA){ // decompress pixels into separate buffer
+            static uint16_t *pix = NULL;
+            static size_t pixsize = 0;
+            size_t hlen = (h.codec == PROTO_DELTA) ? sizeof(uint64_t) : 0; // reference number
+            if(h.paylen < masklen + hlen){
+                WARNX(_("Wrong size of image %llu"), (unsigned long long)h.frameid);
+                return 0;
+            }
+            if(hlen){ // check reference
+                uint64_t r;
+                memcpy(&r, data, sizeof(r));
+                r = le64toh(r);
+                if(!refid || r != refid || refhdr.W != h.W || refhdr.H != h.H || refhdr.binning != h.binning){
+                    putlog("Image %llu: no reference image %llu", (unsigned long long)h.frameid, (unsigned long long)r);
+                    WARNX(_("Can't decompress image %llu: no reference image"), (unsigned long long)h.frameid);
+                    refid = 0;
+                    return 0;
+                }
+            }
+            if(npix > pixsize){
+                FREE(pix);
+                pix = MALLOC(uint16_t, npix);
+                pixsize = npix;
+            }
+            double t0 = dtime();
+            if(hlen ? rice_decode_delta(data + hlen, h.paylen - masklen - hlen, ref, h.W, h.H, colour_step(h.binning), pix)
+                    : rice_decode(data, h.paylen - masklen, h.W, h.H, colour_step(h.binning), pix)){
+                WARNX(_("Can't decompress image %llu"), (unsigned long long)h.frameid);
+                refid = 0;
+                return 0;
+            }
+            double t = dtime() - t0;
+            putlog("Image %llu decompressed: ratio %.2f, %.1f MB/s", (unsigned long long)h.frameid,
+                   (double)(imS + masklen) / h.paylen, t > 0. ? imS / t / 1e6 : 0.);
+            mask = data + h.paylen - masklen;
+            data = (uint8_t*)pix;
+        }else if(h.paylen != imS + masklen){
+            WARNX(_("Wrong size of image %llu"), (unsigned long long)h.frameid);
+            refid = 0;
+            return 0;
+        }
+        if(ccompress == PROTO_DELTA){ // keep image as reference for next one
+            if(npix > refsize){
+                FREE(ref);
+                ref = MALLOC(uint16_t, npix);
+                refsize = npix;
+            }
+            memcpy(ref, data, imS);
+            refhdr = h;
+            refid = h.frameid;
+        }
+        img->binning = h.binning;
+        img->subframe = NULL;
+        if(h.binning == 0xff){
+            F.Xstart = h.subX;
+            F.Ystart = h.subY;
+            F.size = h.subS;
+            img->subframe = &F;
+        }
+        img->exptime = h.exptime / 1e6;
+        img->imtype = h.imtype;
+        img->W = h.W;
+        img->H = h.H;
+        FREE(img->rowmask);
+        img->badrows = h.badrows;
+        if(h.badrows){ // partial image
+            img->rowmask = MALLOC(uint8_t, h.H);
+            memcpy(img->rowmask, mask, h.H);
+        }
+        img->imdata = (uint16_t*)data;
+        forget_stat(); // new data in the same buffer
+        ret = store_image(img);
+    }
+    if(ret){
+        putlog("Error storing image");
+        WARNX(_("Error storing image"));
+    }else putlog("Image saved");
+    return 0;
+}
+
 static void client_(imstorage *img, int sock){
     FNAME();
     if(sock < 0) return;
+    char req[BUFLEN];
+    int L = snprintf(req, BUFLEN, "proto=%d\n", PROTO_VERSION); // old daemon will answer by text
+    if(ccompress == PROTO_RICE) L += snprintf(req + L, BUFLEN - L, "codec=rice\n");
+    else if(ccompress == PROTO_DELTA) L += snprintf(req + L, BUFLEN - L, "codec=delta\n");
+    if(cproduct > -1) L += snprintf(req + L, BUFLEN - L, "product=%s\n", product_name(cproduct));
+    if(cframe > 0) L += snprintf(req + L, BUFLEN - L, "frame=%lld\n", cframe);
+    else if(csince > -1) L += snprintf(req + L, BUFLEN - L, "since=%lld\n", csince);
+    if(L != write(sock, req, L)){
+        WARN("write()");
+        return;
+    }
     size_t Bufsiz = BUFLEN10;
     uint8_t *recvBuff = MALLOC(uint8_t, Bufsiz);
     time_t wd_time = time(NULL); // watchdog time
@@ -440,8 +1751,24 @@ static void client_(imstorage *img, int sock){
             break;
         }
         if(!rd) continue;
-        size_t offset = 0;
-        do{
+        if(read_exact(sock, recvBuff, sizeof(uint32_t))){
+            putlog("Socket closed");
+            break;
+        }
+        uint32_t magic;
+        memcpy(&magic, recvBuff, sizeof(magic));
+        if(le32toh(magic) == PROTO_MAGIC){ // binary frame
+            if(get_frame(img, sock, &recvBuff, &Bufsiz)){
+                putlog("Server disconnected");
+                break;
+            }
+            wd_time = time(NULL); // refresh watchdog - socket OK
+            if(img->once) break;
+            continue;
+        }
+        // text format: read all till pause
+        size_t offset = sizeof(uint32_t);
+        while(waittoread(sock)){
             if(offset >= Bufsiz){
                 Bufsiz += 1024;
                 recvBuff = realloc(recvBuff, Bufsiz);
@@ -462,7 +1789,7 @@ static void client_(imstorage *img, int sock){
                 return;
             }
             offset += n;
-        }while(waittoread(sock));
+        }
         if(!offset){
             putlog("Socket closed");
             WARN("Socket closed\n");
@@ -470,7 +1797,28 @@ static void client_(imstorage *img, int sock){
         }
         DBG("read %zd bytes\n", offset);
         wd_time = time(NULL); // refresh watchdog - socket OK
-        if(get_imstorage(img, recvBuff, offset)){
+        if(offset == Bufsiz){ // place for trailing zero (for findpar)
+            recvBuff = realloc(recvBuff, ++Bufsiz);
+            if(!recvBuff){
+                WARN("realloc()");
+                return;
+            }
+        }
+        recvBuff[offset] = 0;
+        if(strstr((char*)recvBuff, "NO FRAME ")){ // asked image isn't in daemon's ring
+            long first = 0, last = 0;
+            getintpar(recvBuff, "first", &first);
+            getintpar(recvBuff, "last", &last);
+            putlog("Daemon has no image %lld (first=%ld, last=%ld)", cframe, first, last);
+            WARNX(_("Daemon has no image %lld, available numbers: %ld..%ld"), cframe, first, last);
+            break;
+        }
+        if(cproduct > -1){
+            if(store_product(img, recvBuff, offset)){
+                putlog("Error storing image");
+                WARNX(_("Error storing image"));
+            }else putlog("Image saved");
+        }else if(get_imstorage(img, recvBuff, offset)){
             if(store_image(img)){
                 putlog("Error storing image");
                 WARNX(_("Error storing image"));
@@ -26,9 +26,22 @@
 
 #include "imfunctions.h"
 
+// default & maximal amount of last images kept by daemon
+#define RING_LEN    (8)
+#define RING_MAX    (64)
+// default period of key images for clients getting images compressed by previous
+#define KEYFRAMES   (16)
+
 void daemonize(imstorage *img, char *hostname, char *port);
 #ifdef DAEMON
 void set_darks(double exp, double dt);
+int set_ring(int n);
+int set_keyframes(int n);
+#endif
+#ifdef CLIENT
+int set_product(const char *name);
+void set_frames(long long frame, long long since);
+void set_compress(int rice, int delta);
 #endif
 
 #endif // __SOCKET_H__
@@ -20,9 +20,12 @@
  */
 #ifndef CLIENT
 
+#include "chksum.h"
+#include "events.h"
 #include "term.h"
 #include "usefull_macros.h"
 
+#include <math.h>    // fabs
 #include <strings.h> // strncasecmp
 #include <time.h>    // time(NULL)
 
@@ -39,6 +42,12 @@ tcflag_t Bspeeds[] = {
 };
 static const int speedssize = (int)sizeof(Bspeeds)/sizeof(Bspeeds[0]);
 static int curspd = -1;
+static int spdceil = (int)sizeof(Bspeeds)/sizeof(Bspeeds[0]) - 1; // max speed index allowed by link quality
+static int autospeed = 0; // ==1 if speed should be changed by link quality
+static char *curdevice = NULL; // device name for reconnection
+// statistics of last image transfer
+static xfer_stat xstat = {0};
+
 static int speeds[] = {
     9600,
     19200,
@@ -49,6 +58,62 @@ static int speeds[] = {
     460800
 };
 
+// running estimate of latency (Jacobson/Karels algorithm as for TCP RTO)
+typedef struct{
+    double avr;     // smoothed value
+    double var;     // smoothed mean deviation
+    int n;          // amount of measurements
+} latency;
+static latency cmd_lat;  // command -> checksum answer
+static latency blk_lat;  // 'K'/'R'/'X' -> first byte of data block
+static latency stat_lat; // interval between exposition status bytes
+static double last_send = 0.; // time of last command sending
+
+static void lat_add(latency *l, double t){
+    if(!l->n++){
+        l->avr = t; l->var = t / 2.;
+        return;
+    }
+    double d = t - l->avr;
+    l->avr += d / 8.;
+    l->var += (fabs(d) - l->var) / 4.;
+}
+
+/**
+ * Calculate timeout by latency estimate
+ * @param l    - estimate
+ * @param add  - time for data transfer (added to estimate)
+ * @param dflt - default value when there's no measurements
+ * @param min, max - limits
+ */
+static double lat_tmout(latency *l, double add, double dflt, double min, double max){
+    if(!l->n) return dflt;
+    double t = l->avr + 4. * l->var + add;
+    if(t < min) t = min;
+    else if(t > max) t = max;
+    return t;
+}
+
+// forget all estimates (after speed change)
+static void lat_reset(){
+    memset(&cmd_lat, 0, sizeof(latency));
+    memset(&blk_lat, 0, sizeof(latency));
+    memset(&stat_lat, 0, sizeof(latency));
+}
+
+/**
+ * @return time (in seconds) of `n` bytes transfer at current speed
+ */
+static double bytes_time(size_t n){
+    int spd = (curspd < 0) ? speeds[0] : speeds[curspd];
+    return 10. * n / spd; // 8N1: 10 bits per byte
+}
+
+// timeout for command answer of `n` bytes
+static double answer_tmout(size_t n){
+    return lat_tmout(&cmd_lat, 2. * bytes_time(n), WAIT_TMOUT, WAIT_TMOUT_MIN, WAIT_TMOUT_MAX);
+}
+
 // values changed by heater_on() and heater_off() for indirect heater commands
 static int set_heater_on = 0, set_heater_off = 0;
 static time_t heater_period = 600; // default value for heater ON - 10 minutes
@@ -71,6 +136,16 @@ void list_speeds(){
         printf("\t%d\n", speeds[i]);
 }
 
+/**
+ * Get list of speeds available
+ * @param N (o) - amount of speeds
+ * @return array of speeds
+ */
+const int *get_speeds(int *N){
+    if(N) *N = speedssize;
+    return speeds;
+}
+
 /**
  * Return -1 if not connected or value of current speed in bps
  */
@@ -95,6 +170,7 @@ int send_data(uint8_t *buf, int len){
     if(write_tty(&chksum, 1)) return 1;
     DBG("checksum sent");
     last_chksum = chksum;
+    last_send = mtime();
     return 0;
 }
 int send_cmd(uint8_t cmd){
@@ -104,28 +180,32 @@ int send_cmd(uint8_t cmd){
     DBG("Write %c", cmd);
     if(write_tty(s, 2)) return 1;
     last_chksum = s[1];
+    last_send = mtime();
     return 0;
 }
 
+/**
+ * @return time (in seconds) rest till `deadline` (by mtime())
+ */
+static inline double tmleft(double deadline){
+    double t = deadline - mtime();
+    return (t > 0.) ? t : 0.;
+}
+
 /**
  * Wait for answer with checksum
  */
 trans_status wait_checksum(){
     uint8_t chr;
-    int r;
-    double d0 = dtime();
+    double deadline = mtime() + answer_tmout(1);
     do{
-        if((r = read_tty(&chr, 1)) && chr == last_chksum) break;
-        //DBG("wait..");
-    }while(dtime() - d0 < WAIT_TMOUT);
-    if(dtime() - d0 >= WAIT_TMOUT) return TRANS_TIMEOUT;
-    DBG("chksum: got 0x%x, need 0x%x", chr, last_chksum);
-    if(chr != last_chksum){
-        if(chr == 0x7f) return TRANS_TRYAGAIN;
-        else if(chr == ANS_EXP_IN_PROGRESS) return TRANS_BUSY;
-        else return TRANS_BADCHSUM;
-    }
-    return TRANS_SUCCEED;
+        if(read_tty_tmout(&chr, 1, tmleft(deadline)) && chr == last_chksum){
+            DBG("chksum: got 0x%x", chr);
+            lat_add(&cmd_lat, mtime() - last_send);
+            return TRANS_SUCCEED;
+        }
+    }while(mtime() < deadline);
+    return TRANS_TIMEOUT;
 }
 
 /**
@@ -137,22 +217,68 @@ trans_status send_cmd_cs(uint8_t cmd){
     return wait_checksum();
 }
 
-static int download_in_progress = 0; // == 1 when image downloading runs
+static char indi[] = "|/-\\";
+/*
+ * Camera protocol state machine: exposition, readout and image transfer are
+ * driven by cam_process(), which sleeps until next byte from camera, stage
+ * timeout or cam_abort() call from other thread; so caller could do other
+ * work between calls and abort is done immediately
+ */
+static struct{
+    volatile cam_state state;
+    imstorage *img;         // image being transferred
+    double deadline;        // timeout of current stage (by mtime())
+    double tlast;           // time of last exposition status byte
+    char *iptr;             // rotating line
+    // image transfer
+    int xchk;               // ==1 while waiting checksum of CMD_XFER_IMAGE
+    uint16_t *buff;         // image data
+    uint8_t *bptr;          // start of current block in `buff`
+    size_t rest;            // amount of data bytes rest
+    size_t dpsize;          // size of full block (with checksum)
+    size_t need, got;       // size of current block and amount of bytes got
+    uint8_t cs;             // checksum of received part of block
+    int tries, ntries;      // amount of resends of current block and its max value
+    double lastreq;         // time of last request for data
+    double blkreq;          // time of first request for current block
+    double tstart;          // transfer start
+    uint8_t *rowmask;       // rows validity (1 - good) or NULL if there's no lost blocks
+    size_t badrows;         // amount of lost rows
+    uint16_t *spare;        // buffer given by cam_recycle() for next transfer
+    size_t sparelen;        // its size (pixels)
+} cam = {.state = CAM_IDLE, .iptr = indi};
+static volatile int abort_req = 0; // == 1 after cam_abort()
+static int partial_ok = 0; // == 1 to keep images with lost blocks
+
+/**
+ * Allow (p == 1) or deny (p == 0) partial images: blocks which can't be
+ * received are filled by zeros and their rows marked as bad in img->rowmask
+ */
+void set_partial(int p){
+    partial_ok = p;
+}
+
+// states when camera don't accept commands
+static inline int cam_busy(cam_state s){
+    return (s == CAM_EXPOSING || s == CAM_READOUT || s == CAM_TRANSFER || s == CAM_ABORTING);
+}
+
 /**
  * Abort image exposition
- * Used only on exit, so don't check commands status
+ * Used also on exit, so don't check commands status
  */
 void abort_image(){
     putlog("Abort image exposition");
-    uint8_t tmpbuf[4096];
-    if(download_in_progress){
-        read_tty(tmpbuf, 4096);
+    int xfer = (cam.state == CAM_TRANSFER);
+    cam.state = CAM_ABORTING;
+    if(xfer){
+        flush_tty();
         send_cmd(IMTRANS_STOP);
-        download_in_progress = 0;
     }
-    read_tty(tmpbuf, 4096);
+    flush_tty();
     send_cmd_cs(CMD_ABORT_IMAGE);
-    read_tty(tmpbuf, 4096);
+    flush_tty();
+    cam.state = CAM_IDLE;
 }
 
 /**
@@ -162,16 +288,8 @@ void abort_image(){
  * @return number of characters read
  */
 size_t read_string(uint8_t *str, int L){
-    size_t r = 0, l;
-    uint8_t *ptr = str;
-    double d0 = dtime();
-    do{
-        if((l = read_tty(ptr, L))){
-            r += l; L -= l; ptr += l;
-            d0 = dtime();
-        }
-    }while(dtime() - d0 < WAIT_TMOUT);
-    return r;
+    if(L < 1) return 0;
+    return read_tty_all(str, L, answer_tmout(L));
 }
 
 /**
@@ -186,10 +304,7 @@ trans_status wait4answer(uint8_t **rdata, int *rdlen){
     int L = 0;
     trans_status st = wait_checksum();
     if(st != TRANS_SUCCEED) return st;
-    double d0 = dtime();
-    do{
-        if((L = read_tty(buf, sizeof(buf)))) break;
-    }while(dtime() - d0 < WAIT_TMOUT);
+    L = read_tty_tmout(buf, sizeof(buf), answer_tmout(1));
     DBG("read %d bytes, first: 0x%x",L, buf[0]);
     if(!L) return TRANS_TIMEOUT;
     if(rdata) *rdata = buf;
@@ -219,20 +334,24 @@ int chkspeed(int speed){
  */
 int try_connect(char *device, int speed){
     if(!device) return 0;
+    if(curdevice != device){
+        FREE(curdevice);
+        curdevice = strdup(device);
+    }
     int spdstart = 0, spdmax = speedssize;
     if(speed){
         if((spdstart = chkspeed(speed)) < 0) return 0;
         spdmax = spdstart + 1;
     }
-    uint8_t tmpbuf[4096];
     green(_("Connecting to %s...\n"), device);
     for(curspd = spdstart; curspd < spdmax; ++curspd){
         tty_init(device, Bspeeds[curspd]);
-        read_tty(tmpbuf, 4096); // clear rbuf
+        lat_reset();
+        flush_tty(); // clear rbuf
         DBG("Try speed %d", speeds[curspd]);
         int ctr;
         for(ctr = 0; ctr < 10; ++ctr){ // 10 tries to send data
-            read_tty(tmpbuf, 4096); // clear rbuf
+            flush_tty(); // clear rbuf
             if(send_cmd(CMD_COMM_TEST)) continue;
             else break;
         }
@@ -257,6 +376,7 @@ int try_connect(char *device, int speed){
         green(_("Connection established at B%d.\n"), speeds[curspd]);
         return speeds[curspd];
     }
+    curspd = -1;
     putlog("No connection!");
     red(_("No connection!\n"));
     return 0;
@@ -285,14 +405,15 @@ int term_setspeed(int speed){
         return 1;
     }
     tty_init(NULL, Bspeeds[spdidx]); // change speed & wait 'S' as answer
-    double d0 = dtime();
+    lat_reset();
+    double deadline = mtime() + WAIT_TMOUT;
     do{
-        if((L = read_tty(msg, 1))){
+        if((L = read_tty_tmout(msg, 1, tmleft(deadline)))){
             DBG("READ %c", msg[0]);
             if(ANS_CHANGE_BAUDRATE == msg[0])
                 break;
         }
-    }while(dtime() - d0 < WAIT_TMOUT);
+    }while(mtime() < deadline);
     if(L != 1 || msg[0] != ANS_CHANGE_BAUDRATE){
         WARNX(_("Didn't receive the answer"));
         return 1;
@@ -302,7 +423,6 @@ int term_setspeed(int speed){
         WARNX(_("Error in communications"));
         return 1;
     }
-    d0 = dtime();
     if((L = read_string(msg, 6))) msg[L] = 0;
     DBG("got %zd: %s", L, msg);
     if(L != 6 || strcmp((char*)msg, "TestOk")){
@@ -313,10 +433,76 @@ int term_setspeed(int speed){
         WARNX(_("Error in communications"));
         return 1;
     }
+    curspd = spdidx;
+    putlog("Speed changed to %d", speeds[curspd]);
     green(_("Speed changed!\n"));
     return 0;
 }
 
+/**
+ * Measure link quality at current speed: send SPD_PROBE_N communication tests
+ * @return amount of failed tests (stops when it becomes more than SPD_PROBE_MAXERR)
+ */
+static int probe_link(){
+    int errs = 0;
+    for(int i = 0; i < SPD_PROBE_N && errs <= SPD_PROBE_MAXERR; ++i){
+        uint8_t *rd;
+        int l;
+        flush_tty();
+        if(send_cmd(CMD_COMM_TEST) || TRANS_SUCCEED != wait4answer(&rd, &l)
+           || l != 1 || *rd != ANS_COMM_TEST) ++errs;
+    }
+    DBG("%d errors at %d", errs, speeds[curspd]);
+    return errs;
+}
+
+/**
+ * Return to speed with index `spdidx` after failed speed change or reconnect
+ * @return 0 if all OK
+ */
+static int restore_speed(int spdidx){
+    if(!term_setspeed(speeds[spdidx]) && probe_link() <= SPD_PROBE_MAXERR) return 0;
+    putlog("Lost connection, reconnect");
+    // camera could be on any speed now, so check all
+    if(!try_connect(curdevice, 0)) return 1;
+    if(curspd > spdceil) return term_setspeed(speeds[spdceil]);
+    return 0;
+}
+
+/**
+ * Climb to the highest speed which passes link quality test
+ * @return current speed or 0 if connection lost
+ */
+int term_autospeed(){
+    if(curspd < 0) return 0;
+    autospeed = 1;
+    putlog("Search for the best speed");
+    while(curspd < spdceil){
+        int prev = curspd;
+        if(!term_setspeed(speeds[curspd + 1]) && probe_link() <= SPD_PROBE_MAXERR) continue;
+        putlog("Bad link at %d, return to %d", speeds[prev + 1], speeds[prev]);
+        spdceil = prev;
+        if(restore_speed(prev)) return 0;
+    }
+    green(_("Work at speed %d\n"), speeds[curspd]);
+    return speeds[curspd];
+}
+
+/**
+ * Check quality of last image transfer and go to lower speed if there were
+ * too many resends (only after term_autospeed())
+ * @return 0 if all OK
+ */
+int term_checklink(){
+    if(!autospeed || !xstat.blocks || curspd < 1) return 0;
+    double rate = (double)xstat.resends / xstat.blocks;
+    if(rate <= SPD_RESEND_MAX) return 0;
+    putlog("Resend rate %.2f at %d, go to lower speed", rate, speeds[curspd]);
+    spdceil = curspd - 1;
+    xstat.blocks = xstat.resends = 0;
+    return restore_speed(spdceil);
+}
+
 /**
  * run terminal emulation: send user's commands with checksum and show answers
  */
@@ -363,15 +549,19 @@ void heater(heater_cmd cmd){
     if(i < 10) st = wait_checksum();
     if(i == 10 || st != TRANS_SUCCEED){
         putlog("Can't send heater command");
+        event_post(EVENT_ERROR, "\"message\":\"Can't send heater command\"");
         WARNX(_("Can't send heater command: %s"), (st==TRANS_TIMEOUT) ? _("no answer") : _("bad checksum"));
-    }
+    }else event_post(EVENT_HEATER, "\"state\":\"%s\"", (cmd == HEATER_ON) ? "on" : "off");
 }
 
 /**
  * @return static buffer with version string, for example, "V1.10" or "T2.15" ('T' means testing) or NULL
+ * (when camera is busy returns value got last time)
  */
+static char fwversion[256] = {0};
 char *get_firmvare_version(){
-    static char buf[256];
+    char *buf = fwversion;
+    if(cam_busy(cam.state)) return *buf ? buf : NULL;
     if(TRANS_SUCCEED != send_cmd(CMD_FIRMWARE_VERSION)) return NULL;
     if(TRANS_SUCCEED != wait_checksum()) return NULL;
     uint8_t V[2];
@@ -379,6 +569,13 @@ char *get_firmvare_version(){
     snprintf(buf, 256, "%c%d.%d", (V[0] &0x80)?'T':'V', V[0]&0x7f, V[1]);
     return buf;
 }
+/**
+ * @return version string got by last get_firmvare_version() call (or NULL);
+ * doesn't touch the terminal, so could be called from any thread
+ */
+const char *get_firmvare_cached(){
+    return *fwversion ? fwversion : NULL;
+}
 
 /**
  * Send command to shutter
@@ -489,15 +686,10 @@ imsubframe *define_subframe(char *parm){
 }
 
 /**
- * Send command to start exposition & turn heater on/off if got command to do it
- * @param binning - binning to expose
- * @param exptime - exposition time
- * @param imtype  - autodark, light or dark
- * @return 0 if all OK
+ * Turn heater on/off by heater_on()/heater_off() requests or by timeout
+ * (camera shouldn't be busy)
  */
-int start_exposition(imstorage *im, char *imtype){
-    FNAME();
-    // check heater commands
+static void apply_heater(){
     static time_t htr_on_time = 0;
     if(htr_on_time && time(NULL) - htr_on_time > heater_period){
         set_heater_off = 0;
@@ -517,6 +709,24 @@ int start_exposition(imstorage *im, char *imtype){
         heater(HEATER_ON);
         htr_on_time = time(NULL);
     }
+}
+
+/**
+ * Send command to start exposition & turn heater on/off if got command to do it
+ * @param binning - binning to expose
+ * @param exptime - exposition time
+ * @param imtype  - autodark, light or dark
+ * @return 0 if all OK
+ */
+int start_exposition(imstorage *im, char *imtype){
+    FNAME();
+    if(cam_busy(cam.state)){
+        WARNX(_("Camera is busy"));
+        return 9;
+    }
+    // error of last transfer is already processed: failed start shouldn't repeat it
+    if(cam.state == CAM_ERROR) cam.state = CAM_IDLE;
+    apply_heater();
     double exptime = im->exptime;
     uint64_t exp100us = exptime * 10000.;
     static uint8_t cmd[6] = {CMD_TAKE_IMAGE}; // `static` to save all data after first call
@@ -591,6 +801,7 @@ int start_exposition(imstorage *im, char *imtype){
         return 8;
     }
     putlog("start exposition, exptime=%gs", exptime);
+    event_post(EVENT_EXPOSURE, "\"exptime\":%g,\"imtype\":\"%s\",\"binning\":%d", exptime, m, binning);
     im->imtype = it;
     size_t W, H;
     switch(im->binning){ // set image size
@@ -614,141 +825,401 @@ int start_exposition(imstorage *im, char *imtype){
     im->W = W; im->H = H;
     DBG("W=%zd, H=%zd\n", im->W, im->H);
     im->exposetime = time(NULL);
+    cam.tlast = mtime();
+    cam.deadline = cam.tlast + lat_tmout(&stat_lat, bytes_time(1), EXP_DONE_TMOUT,
+                                         EXP_DONE_TMOUT_MIN, EXP_DONE_TMOUT_MAX);
+    cam.iptr = indi;
+    cam.state = CAM_EXPOSING;
+    printf("\nExposure in progress  ");
+    fflush(stdout);
     return 0;
 }
 
-static char indi[] = "|/-\\";
+// consumers of image data blocks
+#define MAX_BLOCK_CONSUMERS     (8)
+static struct{
+    block_consumer fn;
+    void *arg;
+} consumers[MAX_BLOCK_CONSUMERS];
+static int nconsumers = 0;
+
 /**
- * Wait till image ready
+ * Register function which will be called for each verified data block during
+ * image transfer (after camera was asked for next block)
+ * @param fn  - consumer
+ * @param arg - its parameter
  * @return 0 if all OK
  */
-int wait4image(){
-    uint8_t rd = 0;
-    char *iptr = indi;
-    int stage = 1; // 1 - exp in progress, 2 - readout, 3 - done
-    printf("\nExposure in progress  ");
+int add_block_consumer(block_consumer fn, void *arg){
+    if(!fn || nconsumers == MAX_BLOCK_CONSUMERS) return 1;
+    for(int i = 0; i < nconsumers; ++i)
+        if(consumers[i].fn == fn && consumers[i].arg == arg) return 0; // already have
+    consumers[nconsumers].fn = fn;
+    consumers[nconsumers].arg = arg;
+    ++nconsumers;
+    return 0;
+}
+
+/**
+ * Remove all block consumers
+ */
+void clear_block_consumers(){
+    nconsumers = 0;
+}
+
+/**
+ * @return statistics of last image transfer
+ */
+const xfer_stat *get_xfer_stat(){
+    return &xstat;
+}
+
+// process exposition status byte
+static void process_status(uint8_t rd){
+    double t = mtime();
+    // skip interval till first byte
+    if(cam.state == CAM_READOUT || rd == ANS_EXP_IN_PROGRESS) lat_add(&stat_lat, t - cam.tlast);
+    cam.tlast = t;
+    cam.deadline = t + lat_tmout(&stat_lat, bytes_time(1), EXP_DONE_TMOUT,
+                                 EXP_DONE_TMOUT_MIN, EXP_DONE_TMOUT_MAX);
+    cam_state nxt;
+    switch(rd){
+        case ANS_EXP_IN_PROGRESS: nxt = CAM_EXPOSING; break;
+        case ANS_RDOUT_IN_PROGRESS: nxt = CAM_READOUT; break;
+        case ANS_EXP_DONE: nxt = CAM_EXPDONE; break;
+        default:
+            DBG("Unknown status byte: 0x%02x", rd);
+            return;
+    }
+    if(nxt == cam.state){
+        printf("\b%c", *cam.iptr++); // rotating line
+        if(!*cam.iptr) cam.iptr = indi;
+    }else if(nxt == CAM_READOUT) printf(_("\nReadout  "));
+    else if(nxt == CAM_EXPDONE) printf(_("\nDone!\n"));
     fflush(stdout);
-    while(rd != ANS_EXP_DONE){
-        int L = 0;
-        double d0 = dtime();
-        do{
-            if((L = read_tty(&rd, 1))) break;
-        }while(dtime() - d0 < EXP_DONE_TMOUT);
-        if(!L){
-            printf("\n");
-            WARNX(_("CCD not answer"));
-            return 1;
+    cam.state = nxt;
+}
+
+// timeout for data portion: pause between portions should be less than first byte latency
+static double blk_tmout(){
+    return lat_tmout(&blk_lat, bytes_time(64), IMTRANS_TMOUT, IMTRANS_TMOUT_MIN, IMTRANS_TMOUT_MAX);
+}
+
+// prepare to receive next data block
+static void next_block(){
+    cam.need = (cam.rest > cam.dpsize) ? cam.dpsize : cam.rest + 1;
+    cam.got = 0;
+    cam.cs = 0;
+    cam.tries = 0;
+    // amount of tries: as much as could be done in IMTRANS_RETRY_TIME
+    double tblock = bytes_time(cam.need) + blk_lat.avr;
+    cam.ntries = (int)(IMTRANS_RETRY_TIME / tblock);
+    if(cam.ntries < IMTRANS_RETRY_MIN) cam.ntries = IMTRANS_RETRY_MIN;
+    else if(cam.ntries > IMTRANS_RETRY_MAX) cam.ntries = IMTRANS_RETRY_MAX;
+    cam.blkreq = cam.lastreq;
+    cam.deadline = mtime() + blk_tmout();
+    printf("\b%c", *cam.iptr++); // rotating line
+    fflush(stdout);
+    if(!*cam.iptr) cam.iptr = indi;
+}
+
+// stop transfer after error
+static void xfer_fail(){
+    uint8_t c = IMTRANS_STOP;
+    write_tty(&c, 1);
+    printf("\n");
+    WARNX(_("Error receiving data"));
+    FREE(cam.buff);
+    FREE(cam.rowmask);
+    cam.state = CAM_ERROR;
+}
+
+// all data received
+static void xfer_done(){
+    printf("\b Done!\n");
+    putlog("got image data");
+    if(cam.rowmask){
+        putlog("Partial image: %zd rows lost", cam.badrows);
+        WARNX(_("Partial image: %zd of %zd rows lost"), cam.badrows, cam.img->H);
+    }
+    xstat.time = mtime() - cam.tstart;
+    DBG("Got full data packet, capture time: %.1f seconds", xstat.time);
+    cam.state = CAM_READY;
+}
+
+// fill `nbytes` of image data from `start` by zeros and mark their rows as bad
+static void lose_data(uint8_t *start, size_t nbytes){
+    if(!nbytes) return;
+    size_t W = cam.img->W, H = cam.img->H, offset = (start - (uint8_t*)cam.buff) / 2;
+    size_t first = offset / W, last = (offset + nbytes / 2 - 1) / W;
+    memset(start, 0, nbytes);
+    if(!cam.rowmask){
+        cam.rowmask = MALLOC(uint8_t, H);
+        memset(cam.rowmask, 1, H);
+    }
+    for(size_t r = first; r <= last && r < H; ++r){
+        if(!cam.rowmask[r]) continue;
+        cam.rowmask[r] = 0;
+        ++cam.badrows;
+    }
+    ++xstat.lost;
+}
+
+// skip block which can't be received (partial image)
+static void skip_block(){
+    DBG("Skip block");
+    uint8_t c = IMTRANS_CONTINUE;
+    write_tty(&c, 1);
+    cam.lastreq = mtime();
+    lose_data(cam.bptr, cam.need - 1);
+    cam.rest -= cam.need - 1;
+    cam.bptr += cam.need - 1;
+    if(!cam.rest) xfer_done();
+    else next_block();
+}
+
+// check full block & ask for next one or resend
+static void block_done(){
+    uint8_t c, *ptr = cam.bptr + cam.need - 1; // *ptr is checksum
+    if(*ptr != cam.cs){
+        DBG("Ask to resend data");
+        ++xstat.resends;
+        if(++cam.tries >= cam.ntries){
+            DBG("not reached");
+            if(partial_ok) skip_block();
+            else xfer_fail();
+            return;
         }
-        int nxtstage = 1;
-        if(rd != ANS_EXP_IN_PROGRESS){
-            if(rd == ANS_RDOUT_IN_PROGRESS) nxtstage = 2;
-            else nxtstage = 3;
+        c = IMTRANS_RESEND;
+        write_tty(&c, 1);
+        cam.lastreq = mtime();
+        cam.got = 0;
+        cam.cs = 0;
+        cam.deadline = cam.lastreq + blk_tmout();
+        return;
+    }
+    c = IMTRANS_CONTINUE;
+    write_tty(&c, 1);
+    cam.lastreq = mtime();
+    cam.rest -= cam.need - 1;
+    if(xstat.blocks == xstat.maxblocks){
+        xstat.maxblocks += 64;
+        xstat.blktime = realloc(xstat.blktime, xstat.maxblocks * sizeof(double));
+        if(!xstat.blktime) ERR("realloc()");
+    }
+    xstat.blktime[xstat.blocks++] = cam.lastreq - cam.blkreq;
+    xstat.bytes += cam.need - 1;
+    // camera already sends next block, process this one
+    uint8_t *start = cam.bptr;
+    size_t offset = (start - (uint8_t*)cam.buff) / 2, npix = (cam.need - 1) / 2;
+    for(int i = 0; i < nconsumers; ++i)
+        consumers[i].fn(cam.img, (uint16_t*)start, offset, npix, consumers[i].arg);
+    cam.bptr = ptr;
+    if(!cam.rest) xfer_done();
+    else next_block();
+}
+
+// process data came during image transfer
+static void process_xfer(){
+    if(cam.xchk){ // wait for transfer command checksum
+        uint8_t chr;
+        while(read_tty_tmout(&chr, 1, 0.)){
+            if(chr != last_chksum) continue;
+            lat_add(&cmd_lat, mtime() - last_send);
+            cam.xchk = 0;
+            cam.lastreq = cam.tstart = mtime();
+            next_block();
+            break;
         }
-        if(nxtstage == stage){
-            printf("\b%c", *iptr++); // rotating line
-            fflush(stdout);
-            if(!*iptr) iptr = indi;
-        }else{
-            stage = nxtstage;
-            if(stage == 2){
-                printf(_("\nReadout  "));
-                fflush(stdout);
-            }else printf(_("\nDone!\n"));
+        if(cam.xchk) return;
+    }
+    size_t r;
+    // calculate checksum of each portion just after it comes
+    while(cam.state == CAM_TRANSFER && (r = read_tty_tmout(cam.bptr + cam.got, cam.need - cam.got, 0.))){
+        if(!cam.got) lat_add(&blk_lat, mtime() - cam.lastreq);
+        size_t end = cam.got + r;
+        if(end == cam.need) --end; // last byte is checksum
+        if(end > cam.got) cam.cs ^= xor_chksum(cam.bptr + cam.got, end - cam.got);
+        cam.got += r;
+        cam.deadline = mtime() + blk_tmout();
+        if(cam.got == cam.need) block_done();
+    }
+}
+
+// stage timeout
+static void process_tmout(){
+    if(cam.state == CAM_TRANSFER){
+        if(partial_ok && !cam.xchk && xstat.blocks){ // keep what we have
+            uint8_t c = IMTRANS_STOP;
+            write_tty(&c, 1);
+            lose_data(cam.bptr, cam.rest);
+            cam.rest = 0;
+            xfer_done();
+        }else xfer_fail();
+        return;
+    }
+    printf("\n");
+    WARNX(_("CCD not answer"));
+    cam.state = CAM_ERROR;
+}
+
+/**
+ * Run camera state machine: wait for data from camera not more than `tmout`
+ * seconds and process it. Returns immediately when camera isn't busy or state
+ * changes to not busy (heater commands are sent at this moment)
+ * @return current state
+ */
+cam_state cam_process(double tmout){
+    double end = mtime() + tmout;
+    while(1){
+        if(abort_req){
+            abort_req = 0;
+            abort_image();
+            FREE(cam.buff);
+            FREE(cam.rowmask);
+            break;
+        }
+        if(!cam_busy(cam.state)){
+            apply_heater();
+            break;
+        }
+        double now = mtime();
+        if(now >= cam.deadline){
+            process_tmout();
+            continue;
+        }
+        if(now >= end) break;
+        double dl = (end < cam.deadline) ? end : cam.deadline;
+        if(tty_wait(dl - now) < 1) continue; // timeout or wakeup
+        if(cam.state == CAM_TRANSFER) process_xfer();
+        else{
+            uint8_t rd;
+            while((cam.state == CAM_EXPOSING || cam.state == CAM_READOUT) && read_tty_tmout(&rd, 1, 0.))
+                process_status(rd);
         }
     }
-    return 0;
+    return cam.state;
 }
 
 /**
- * Collect data by serial terminal
+ * @return current state of camera
+ */
+cam_state cam_getstate(){
+    return cam.state;
+}
+
+/**
+ * @return name of camera state `s`
+ */
+const char *cam_statename(cam_state s){
+    switch(s){
+        case CAM_IDLE:      return "idle";
+        case CAM_EXPOSING:  return "exposing";
+        case CAM_READOUT:   return "readout";
+        case CAM_EXPDONE:   return "expdone";
+        case CAM_TRANSFER:  return "transfer";
+        case CAM_READY:     return "ready";
+        case CAM_ABORTING:  return "aborting";
+        case CAM_ERROR:     return "error";
+    }
+    return "unknown";
+}
+
+/**
+ * Abort current exposition or transfer: thread-safe, cam_process() will do
+ * it immediately
+ */
+void cam_abort(){
+    abort_req = 1;
+    tty_wakeup();
+}
+
+/**
+ * Ask camera to send image
  * @param img - parameters of exposed image
- * @return array with image data (allocated here) or NULL
+ * @return 0 if all OK
  */
-uint16_t *get_image(imstorage *img){
-    char *iptr = indi;
-    size_t L = img->W * img->H, rest = L * sizeof(uint16_t); // rest is datasize in bytes
+int cam_xfer(imstorage *img){
+    if(!img || cam_busy(cam.state)) return 1;
+    size_t L = img->W * img->H;
     DBG("L = %zd, W=%zd, H=%zd", L, img->W, img->H);
-    uint16_t *buff = MALLOC(uint16_t, L);
-    if(TRANS_SUCCEED != send_cmd_cs(CMD_XFER_IMAGE)){
+    FREE(cam.buff);
+    FREE(cam.rowmask);
+    FREE(img->rowmask);
+    img->badrows = cam.badrows = 0;
+    if(cam.spare && cam.sparelen >= L + 1){ // reuse buffer of old image
+        cam.buff = cam.spare;
+        cam.spare = NULL;
+    }else cam.buff = MALLOC(uint16_t, L + 1); // +1 for last block checksum
+    if(send_cmd(CMD_XFER_IMAGE)){
         WARNX(_("Error sending transfer command"));
-        FREE(buff);
-        return NULL;
-    }
-    download_in_progress = 1;
-    #ifdef EBUG
-    double tstart = dtime();
-    #endif
-    DBG("rest = %zd", rest);
-    uint8_t *getdataportion(uint8_t *start, size_t l){ // return last byte read + 1
-        int i;
-        uint8_t cs = 0;
-        for(i = 0; i < 4; ++i){ // four tries to get datablock
-            size_t r = 0, got = 0;
-            uint8_t *ptr = start;
-            double d0 = dtime();
-            do{
-                if((r = read_tty(ptr, l))){
-                    d0 = dtime();
-                    ptr += r;
-                    got += r;
-                    l -= r;
-                }
-            }while(l && dtime() - d0 < IMTRANS_TMOUT);
-            //DBG("got: %zd, time: %g, l=%zd", got, dtime()-d0, l);
-            if(l){
-                cs = IMTRANS_STOP;
-                write_tty(&cs, 1);
-                return NULL; // nothing to read
-            }
-            --ptr; // *ptr is checksum
-            while(start < ptr) cs ^= *start++;
-            //DBG("got checksum: %x, calc: %x", *ptr, cs);
-            if(*ptr == cs){ // all OK
-                //DBG("Checksum good");
-                cs = IMTRANS_CONTINUE;
-                write_tty(&cs, 1);
-                return ptr;
-            }else{ // bad checksum
-                DBG("Ask to resend data");
-                cs = IMTRANS_RESEND;
-                write_tty(&cs, 1);
-            }
-        }
-        DBG("not reached");
-        cs = IMTRANS_STOP;
-        write_tty(&cs, 1);
-        return NULL;
+        FREE(cam.buff);
+        cam.state = CAM_ERROR;
+        return 1;
     }
-    uint8_t *bptr = (uint8_t*) buff;
-    //int i = 0;
+    cam.img = img;
+    cam.xchk = 1;
+    cam.rest = L * sizeof(uint16_t);
+    cam.bptr = (uint8_t*) cam.buff;
     // size of single block: 4096 pix in full frame or 1x1bin mode, 1024 in binned mode, subfrmsize in subframe mode
-    size_t dpsize = 4096*2 + 1;
-    if(img->binning == 2) dpsize = 1024*2 + 1;
-    else if(img->binning == 0xff) dpsize = 2*img->subframe->size + 1;
+    cam.dpsize = 4096*2 + 1;
+    if(img->binning == 2) cam.dpsize = 1024*2 + 1;
+    else if(img->binning == 0xff) cam.dpsize = 2*img->subframe->size + 1;
+    cam.deadline = mtime() + answer_tmout(1);
+    cam.iptr = indi;
+    xstat.blocks = xstat.resends = xstat.bytes = xstat.lost = 0;
+    xstat.time = 0.;
+    cam.state = CAM_TRANSFER;
     printf("Transfer data  "); fflush(stdout);
-    do{
-        size_t need = (rest > dpsize) ? dpsize : rest + 1;
-        //DBG("I want %zd bytes", need);
-        printf("\b%c", *iptr++); // rotating line
-        fflush(stdout);
-        if(!*iptr) iptr = indi;
-        uint8_t *ptr = getdataportion(bptr, need);
-        if(!ptr){
-            printf("\n");
-            WARNX(_("Error receiving data"));
-            FREE(buff);
-            download_in_progress = 0;
-            return NULL;
-        }
-        rest -= need - 1;
-        //DBG("need: %zd", need);
-        bptr = ptr;
-    }while(rest);
-    printf("\b Done!\n");
-    putlog("got image data");
-    DBG("Got full data packet, capture time: %.1f seconds", dtime() - tstart);
-    download_in_progress = 0;
-    return buff;
+    return 0;
+}
+
+/**
+ * Give buffer of old image for next transfers (to avoid allocation)
+ * @param buf - buffer (will be free'd here if not needed)
+ * @param L   - its size (pixels)
+ */
+void cam_recycle(uint16_t *buf, size_t L){
+    FREE(cam.spare);
+    cam.spare = buf;
+    cam.sparelen = L;
+}
+
+/**
+ * Take received image (rows mask of partial image goes to img->rowmask)
+ * @return image data (should be free'd outside) or NULL if there's no image
+ */
+uint16_t *cam_getimage(){
+    if(cam.state != CAM_READY) return NULL;
+    uint16_t *b = cam.buff;
+    cam.buff = NULL;
+    cam.img->rowmask = cam.rowmask;
+    cam.img->badrows = cam.badrows;
+    cam.rowmask = NULL;
+    cam.state = CAM_IDLE;
+    return b;
+}
+
+/**
+ * Wait till image ready
+ * @return 0 if all OK
+ */
+int wait4image(){
+    cam_state st;
+    do st = cam_process(EXP_DONE_TMOUT_MAX);
+    while(st == CAM_EXPOSING || st == CAM_READOUT);
+    return (st == CAM_EXPDONE) ? 0 : 1;
+}
+
+/**
+ * Collect data by serial terminal
+ * @param img - parameters of exposed image
+ * @return array with image data (allocated here) or NULL
+ */
+uint16_t *get_image(imstorage *img){
+    if(cam_xfer(img)) return NULL;
+    while(cam_process(IMTRANS_TMOUT_MAX) == CAM_TRANSFER);
+    return cam_getimage();
 }
 
 
@@ -23,12 +23,33 @@
 #define __TERM_H__
 #include "imfunctions.h"
 
+/*
+ * Timeouts below are used until latency at current speed is measured, after
+ * that timeouts are calculated by running estimate of latency (like TCP RTO)
+ * and limited by ..._MIN and ..._MAX values
+ */
 // terminal timeout (seconds)
 #define     WAIT_TMOUT      (0.2)
+#define     WAIT_TMOUT_MIN  (0.05)
+#define     WAIT_TMOUT_MAX  (1.0)
 // timeout waitint 'D'
 #define     EXP_DONE_TMOUT  (5.0)
+#define     EXP_DONE_TMOUT_MIN (2.0)
+#define     EXP_DONE_TMOUT_MAX (10.0)
 // dataportion transfer timeout
 #define     IMTRANS_TMOUT   (3.0)
+#define     IMTRANS_TMOUT_MIN (0.1)
+#define     IMTRANS_TMOUT_MAX (10.0)
+// time (in seconds) allowed for resending of one block: amount of tries depends on speed
+#define     IMTRANS_RETRY_TIME (30.0)
+#define     IMTRANS_RETRY_MIN  (2)
+#define     IMTRANS_RETRY_MAX  (8)
+// amount of communication tests to check link quality at new speed
+#define     SPD_PROBE_N     (32)
+// maximal amount of failed tests allowed
+#define     SPD_PROBE_MAXERR (1)
+// maximal part of resent blocks in image transfer before speed decrease
+#define     SPD_RESEND_MAX  (0.05)
 // image size
 #define     IMWIDTH         (640)
 #define     IM_CROPWIDTH    (512)
@@ -80,6 +101,39 @@ typedef enum{
 #define     ANS_RDOUT_IN_PROGRESS   'R'
 #define     ANS_EXP_DONE            'D'
 
+// states of camera protocol state machine
+typedef enum{
+    CAM_IDLE = 0,       // camera is free
+    CAM_EXPOSING,       // exposition in progress
+    CAM_READOUT,        // readout in progress
+    CAM_EXPDONE,        // exposition done, image could be transferred
+    CAM_TRANSFER,       // receiving image data blocks
+    CAM_READY,          // image received, take it by cam_getimage()
+    CAM_ABORTING,       // aborting exposition or transfer
+    CAM_ERROR           // camera not answer or transfer failed
+} cam_state;
+
+/**
+ * Image data block consumer
+ * @param img    - image being transferred (img->imdata isn't set yet!)
+ * @param data   - block data
+ * @param offset - index of first block pixel in image (0 for first block of new image)
+ * @param npix   - amount of pixels in block
+ * @param arg    - argument given in add_block_consumer()
+ */
+typedef void (*block_consumer)(imstorage *img, const uint16_t *data, size_t offset, size_t npix, void *arg);
+
+// statistics of last image transfer
+typedef struct{
+    size_t blocks;      // amount of blocks received
+    size_t resends;     // amount of resend requests
+    size_t bytes;       // amount of data bytes received
+    size_t lost;        // amount of blocks lost (partial image)
+    double time;        // transfer time (seconds), 0 if transfer failed
+    double *blktime;    // time of each block receiving: from request till right checksum
+    size_t maxblocks;   // size of `blktime` array
+} xfer_stat;
+
 void run_terminal();
 int open_serial(char *dev);
 int get_curspeed();
@@ -91,14 +145,29 @@ void heater_off();
 void set_heater_period(int p);
 
 void list_speeds();
+const int *get_speeds(int *N);
 void abort_image();
 int term_setspeed(int speed);
+int term_autospeed();
+int term_checklink();
 char *get_firmvare_version();
+const char *get_firmvare_cached();
 int shutter_command(char *cmd);
 imsubframe *define_subframe(char *parm);
 int start_exposition(imstorage *im, char *imtype);
 int wait4image();
 uint16_t *get_image(imstorage *img);
 void set_heater_period(int p);
+int add_block_consumer(block_consumer fn, void *arg);
+void clear_block_consumers();
+const xfer_stat *get_xfer_stat();
+cam_state cam_process(double tmout);
+cam_state cam_getstate();
+const char *cam_statename(cam_state s);
+void cam_abort();
+void set_partial(int p);
+int cam_xfer(imstorage *img);
+uint16_t *cam_getimage();
+void cam_recycle(uint16_t *buf, size_t L);
 
 #endif // __TERM_H__
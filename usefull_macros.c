@@ -21,6 +21,8 @@
 
 #include "usefull_macros.h"
 #include <linux/limits.h> // PATH_MAX
+#include <poll.h>         // ppoll
+#include <sys/eventfd.h>  // eventfd
 
 /**
  * function for different purposes that need to know time intervals
@@ -271,10 +273,23 @@ int mygetchar(){ // getchar() without need of pressing ENTER
 
 
 /******************************************************************************\
- *                              TTY with select()
+ *                              TTY with ppoll()
 \******************************************************************************/
 static struct termio oldtty, tty; // TTY flags
 static int comfd = -1; // TTY fd
+static int wakefd = -1; // eventfd to break tty_wait() from other threads
+
+/*
+ * TTY input goes through ring buffer `ttyrb`: each read() takes all data kernel
+ * have, so single bytes of answers are served without syscalls; waiting for
+ * data is done by ppoll() with deadline, so process sleeps until byte arrives
+ * or timeout expires (no periodical wakeups)
+ */
+#ifndef TTY_RBUF_SZ
+#define TTY_RBUF_SZ     (16384)
+#endif
+static uint8_t ttyrb[TTY_RBUF_SZ];
+static size_t ttyrb_head = 0, ttyrb_tail = 0; // read from head, write to tail
 
 // run on exit:
 void restore_tty(){
@@ -302,6 +317,8 @@ void tty_init(char *comdev, tcflag_t speed){
             WARN(_("Can't open port %s"),comdev);
             signals(2);
         }
+        if(wakefd < 0 && (wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            WARN("eventfd()");
     /*    DBG("OK\nGet current settings...");
         if(ioctl(comfd, TCGETA, &oldtty) < 0){  // Get settings
             /// "   "
@@ -316,6 +333,7 @@ void tty_init(char *comdev, tcflag_t speed){
             signals(2);
         }
     }
+    ttyrb_head = ttyrb_tail = 0; // data on old speed is garbage
     tty = oldtty;
     tty.c_lflag     = 0; // ~(ICANON | ECHO | ECHOE | ISIG)
     tty.c_oflag     = 0;
@@ -330,26 +348,138 @@ void tty_init(char *comdev, tcflag_t speed){
     DBG("OK");
 }
 /**
- * Read data from TTY
+ * monotonic time for deadlines (not affected by system time changes)
+ * @return time in seconds
+ */
+double mtime(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ((double)ts.tv_nsec)/1e9;
+}
+
+// amount of data in ring buffer
+static inline size_t ttyrb_used(){
+    return ttyrb_tail - ttyrb_head;
+}
+
+// copy not more than `length` bytes from ring buffer
+static size_t ttyrb_get(uint8_t *buff, size_t length){
+    size_t used = ttyrb_used();
+    if(length > used) length = used;
+    size_t h = ttyrb_head % TTY_RBUF_SZ, part = TTY_RBUF_SZ - h;
+    if(part > length) part = length;
+    memcpy(buff, ttyrb + h, part);
+    if(length > part) memcpy(buff + part, ttyrb, length - part);
+    ttyrb_head += length;
+    if(ttyrb_head == ttyrb_tail) ttyrb_head = ttyrb_tail = 0;
+    return length;
+}
+
+/**
+ * Wait for data on TTY until `deadline` (by mtime()) & fill ring buffer
+ * @param deadline  - time by mtime(), deadline <= 0 means "don't wait"
+ * @param woken (o) - if not NULL, wait for tty_wakeup() too and set *woken=1 when it called
+ * @return amount of bytes added to ring buffer
+ */
+static size_t ttyrb_fill(double deadline, int *woken){
+    struct pollfd pfd[2] = {{.fd = comfd, .events = POLLIN}, {.fd = wakefd, .events = POLLIN}};
+    struct timespec ts = {0, 0};
+    int retval, nfds = (woken && wakefd > -1) ? 2 : 1;
+    do{
+        if(deadline > 0.){
+            double rest = deadline - mtime();
+            if(rest < 0.) rest = 0.;
+            ts.tv_sec = (time_t) rest;
+            ts.tv_nsec = (long)((rest - ts.tv_sec) * 1e9);
+        }
+        retval = ppoll(pfd, nfds, &ts, NULL);
+    }while(retval < 0 && errno == EINTR);
+    if(nfds == 2 && (pfd[1].revents & POLLIN)){
+        uint64_t cnt;
+        if(read(wakefd, &cnt, sizeof(cnt)) > 0) *woken = 1;
+    }
+    if(retval < 1 || !(pfd[0].revents & POLLIN)) return 0;
+    size_t got = 0;
+    while(ttyrb_used() < TTY_RBUF_SZ){
+        size_t t = ttyrb_tail % TTY_RBUF_SZ, space = TTY_RBUF_SZ - ttyrb_used();
+        if(space > TTY_RBUF_SZ - t) space = TTY_RBUF_SZ - t;
+        ssize_t L = read(comfd, ttyrb + t, space);
+        if(L < 1) break;
+        ttyrb_tail += L;
+        got += L;
+        if((size_t)L < space) break; // nothing more in kernel buffer
+    }
+    return got;
+}
+
+/**
+ * Read data from TTY waiting not more than `tmout` seconds for first portion
  * @param buff (o) - buffer for data read
  * @param length   - buffer len
- * @return amount of readed bytes
+ * @param tmout    - timeout (in seconds)
+ * @return amount of readed bytes (returns immediately when any data available)
  */
-size_t read_tty(uint8_t *buff, size_t length){
+size_t read_tty_tmout(uint8_t *buff, size_t length, double tmout){
+    if(comfd < 0 || !length) return 0;
+    if(!ttyrb_used()) ttyrb_fill(mtime() + tmout, NULL);
+    return ttyrb_get(buff, length);
+}
+
+/**
+ * Wait for data on TTY not more than `tmout` seconds or till tty_wakeup() call
+ * @return 1 if there's data to read, 0 in case of timeout, -1 if woken up
+ */
+int tty_wait(double tmout){
     if(comfd < 0) return 0;
-    ssize_t L = 0;
-    fd_set rfds;
-    struct timeval tv;
-    int retval;
-    FD_ZERO(&rfds);
-    FD_SET(comfd, &rfds);
-    tv.tv_sec = 0; tv.tv_usec = 50000; // wait for 50ms
-    retval = select(comfd + 1, &rfds, NULL, NULL, &tv);
-    if (!retval) return 0;
-    if(FD_ISSET(comfd, &rfds)){
-        if((L = read(comfd, buff, length)) < 1) return 0;
+    if(ttyrb_used()) return 1;
+    int woken = 0;
+    if(ttyrb_fill(mtime() + tmout, &woken)) return 1;
+    return woken ? -1 : 0;
+}
+
+/**
+ * Break tty_wait() (could be called from any thread)
+ */
+void tty_wakeup(){
+    if(wakefd < 0) return;
+    uint64_t one = 1;
+    if(write(wakefd, &one, sizeof(one)) < 0) WARN("write()");
+}
+
+/**
+ * Read exactly `length` bytes from TTY
+ * @param buff (o) - buffer for data read
+ * @param length   - amount of data to read
+ * @param tmout    - maximal pause between data portions (in seconds)
+ * @return amount of readed bytes (less than `length` in case of timeout)
+ */
+size_t read_tty_all(uint8_t *buff, size_t length, double tmout){
+    size_t got = 0;
+    while(got < length){
+        size_t L = read_tty_tmout(buff + got, length - got, tmout);
+        if(!L) break;
+        got += L;
     }
-    return (size_t)L;
+    return got;
+}
+
+/**
+ * Read data from TTY (wait not more than 50ms)
+ * @param buff (o) - buffer for data read
+ * @param length   - buffer len
+ * @return amount of readed bytes
+ */
+size_t read_tty(uint8_t *buff, size_t length){
+    return read_tty_tmout(buff, length, 0.05);
+}
+
+/**
+ * Throw out all data from TTY input
+ */
+void flush_tty(){
+    if(comfd < 0) return;
+    ttyrb_head = ttyrb_tail = 0;
+    while(ttyrb_fill(0., NULL)) ttyrb_head = ttyrb_tail = 0;
 }
 
 int write_tty(const uint8_t *buff, size_t length){
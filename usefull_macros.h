@@ -110,6 +110,7 @@ extern void signals(int sig);
 #endif
 
 double dtime();
+double mtime();
 
 // functions for color output in tty & no-color in pipes
 extern int (*red)(const char *fmt, ...);
@@ -134,6 +135,11 @@ int mygetchar();
 void restore_tty();
 void tty_init(char *comdev, tcflag_t speed);
 size_t read_tty(uint8_t *buff, size_t length);
+size_t read_tty_tmout(uint8_t *buff, size_t length, double tmout);
+size_t read_tty_all(uint8_t *buff, size_t length, double tmout);
+int tty_wait(double tmout);
+void tty_wakeup();
+void flush_tty();
 int write_tty(const uint8_t *buff, size_t length);
 
 int str2double(double *num, const char *str);